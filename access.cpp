@@ -28,6 +28,7 @@
 #include <vlc_url.h>
 #include <vlc_input_item.h>
 #include <vlc_configuration.h>
+#include <vlc_interrupt.h>
 
 #include "torrent.h"
 
@@ -37,16 +38,29 @@ static int ReadDir(access_t*, input_item_node_t*);
 static int Control(access_t*, int, va_list);
 static int Seek(access_t*, uint64_t);
 static block_t* Block(access_t*);
+static ssize_t Read(access_t*, uint8_t*, size_t);
 
 struct access_sys_t
 {
     TorrentAccess torrent;
+    AccessTrace   trace;
+};
+
+// Block referencing a slice of a piece, the piece buffer is shared between all its slices.
+struct PieceBlock : block_t
+{
+    boost::shared_array<char> buffer;
 };
 
 /*****************************************************************************
  * Module descriptor
  *****************************************************************************/
 
+static const char* const ppsz_profiles[] = {"desktop", "embedded", "server"};
+static const char* const ppsz_profile_names[] = {
+    N_("Desktop"), N_("Low-memory embedded"), N_("High-throughput server")
+};
+
 vlc_module_begin()
 
     set_shortname(N_("Torrent streaming"))
@@ -71,6 +85,26 @@ vlc_module_begin()
       N_("Maximum download rate in kilobytes per second"), false)
     add_float("share-ratio-limit", 2.0, N_("Share ratio limit"),
       N_("Share ratio limit to maintain (uploaded bytes / downloaded bytes)"), false)
+    add_integer("torrent-block-size", 0, N_("Block size (kB) [0=piece size]"),
+      N_("Pieces are coalesced or split into blocks of this size before being handed to the demuxer"), true)
+    add_bool("torrent-stream-read", false, N_("Byte stream reads"),
+      N_("Serve exactly the amount of data requested by the demuxer instead of blocks"), true)
+    add_integer("piece-cache-size", 16, N_("Piece cache size (MiB)"),
+      N_("Amount of memory used to keep the last pieces read, so that seeking within them is immediate. "
+         "One piece is always kept, even when larger than this size, 0 disables the cache"), true)
+    add_integer("pause-buffer-size", 64, N_("Pause buffer size (MiB)"),
+      N_("Amount of data downloaded ahead of the playback position while paused"), true)
+    add_integer("pause-download-rate-limit", 0, N_("Pause download rate limit (kB/s) [0=unlimited]"),
+      N_("Maximum download rate in kilobytes per second while paused"), true)
+    add_savefile("torrent-stats-file", nullptr, N_("Statistics file"),
+      N_("File where the piece latency and read wait histograms are appended when playback stops"), true)
+    add_integer("background-download-threshold", 20, N_("Background download threshold (s) [0=always]"),
+      N_("Duration buffered ahead of the playback position required before downloading the rest of the file"), true)
+    add_string("torrent-profile", "desktop", N_("Session profile"),
+      N_("Disk queue, cache, request queue and connection limits suited to the device"), true)
+      change_string_list(ppsz_profiles, ppsz_profile_names)
+    add_savefile("torrent-trace-file", nullptr, N_("Access trace file"),
+      N_("File where the seeks and reads of the demuxer are recorded, to be replayed by the benchmarks"), true)
 
 vlc_module_end()
 
@@ -97,7 +131,7 @@ static int open(access_t* p_access)
     if (dir == nullptr)
         return VLC_EGENERIC;
 
-    p_access->p_sys = new access_sys_t{{p_access}};
+    p_access->p_sys = new access_sys_t{{p_access}, {}};
     auto& torrent = p_access->p_sys->torrent;
     auto file_at = var_InheritInteger(p_access, "torrent-file-index");
 
@@ -117,8 +151,16 @@ static int open(access_t* p_access)
     }
     else {
         // Torrent file has been browsed, start the download.
-        ACCESS_SET_CALLBACKS(nullptr, Block, Control, Seek);
-        torrent.StartDownload(file_at);
+        if (var_InheritBool(p_access, "torrent-stream-read"))
+            ACCESS_SET_CALLBACKS(Read, nullptr, Control, Seek);
+        else
+            ACCESS_SET_CALLBACKS(nullptr, Block, Control, Seek);
+        if (torrent.StartDownload(file_at) != VLC_SUCCESS)
+            return VLC_EGENERIC;
+
+        const auto trace = unique_char_ptr{var_InheritString(p_access, "torrent-trace-file"), std::free};
+        if (trace != nullptr && !p_access->p_sys->trace.Open(trace.get(), torrent.file_size()))
+            msg_Warn(p_access, "Could not open the trace file %s", trace.get());
         return VLC_SUCCESS;
     }
 }
@@ -165,14 +207,13 @@ static int ReadDir(access_t* p_access, input_item_node_t* p_node)
 
     ItemsHeap items;
     for (auto i = 0; i < metadata.num_files(); ++i) {
-        const auto f = metadata.file_at(i);
         const auto psz_uri = torrent.uri().c_str();
-        const auto psz_name = files.file_name(i);
+        const auto psz_name = std::string(files.file_name(file_index(i)));
         const auto psz_option = "torrent-file-index=" + std::to_string(i);
 
         auto p_item = input_item_New(psz_uri, psz_name.c_str());
         input_item_AddOption(p_item, psz_option.c_str(), VLC_INPUT_OPTION_TRUSTED);
-        items[f.size] = p_item;
+        items[files.file_size(file_index(i))] = p_item;
     }
     std::for_each(items.rbegin(), items.rend(), [p_node](ItemsHeap::value_type& p) {
         input_item_node_AppendItem(p_node, p.second);
@@ -195,12 +236,17 @@ static int Control(access_t* p_access, int i_query, va_list args)
         *va_arg(args, bool*) = true;
         break;
 
+    case ACCESS_GET_SIZE:
+        *va_arg(args, uint64_t*) = p_access->p_sys->torrent.file_size();
+        break;
+
     case ACCESS_GET_PTS_DELAY:
-        *va_arg(args, int64_t*) = DEFAULT_PTS_DELAY * 1000;
+        *va_arg(args, int64_t*) = p_access->p_sys->torrent.PtsDelay();
         break;
 
     case ACCESS_SET_PAUSE_STATE:
-        return VLC_SUCCESS;
+        p_access->p_sys->torrent.SetPaused(va_arg(args, int));
+        break;
 
     case ACCESS_GET_TITLE_INFO:
     case ACCESS_SET_TITLE:
@@ -215,25 +261,123 @@ static int Control(access_t* p_access, int i_query, va_list args)
     return VLC_SUCCESS;
 }
 
+static void InterruptRead(void* data)
+{
+    static_cast<TorrentAccess*>(data)->InterruptWait();
+}
+
+static void ReadNextPiece(access_t* p_access, Piece& p, bool& eof, uint64_t max_length)
+{
+    using namespace std::chrono;
+
+    // Short enough not to hold the other controls (pause, seek...) behind a read, only stop interrupts it.
+    const auto timeout = milliseconds{100};
+    const auto start = steady_clock::now();
+    auto& torrent = p_access->p_sys->torrent;
+
+    torrent.ReadNextPiece(p, eof, max_length);
+    if (!eof && p.data == nullptr) {
+        // Nothing to read yet, wait for the torrent to signal us and try once more.
+        // The wait is aborted as soon as the input gets interrupted, i.e. stopped.
+        vlc_interrupt_register(InterruptRead, &torrent);
+        const auto ready = torrent.WaitReady(timeout);
+        vlc_interrupt_unregister();
+        if (ready)
+            torrent.ReadNextPiece(p, eof, max_length);
+    }
+    torrent.CountRead(duration_cast<microseconds>(steady_clock::now() - start), !eof && p.data == nullptr);
+}
+
+static void PieceBlockRelease(block_t* p_block)
+{
+    delete static_cast<PieceBlock*>(p_block);
+}
+
+static block_t* PieceBlockNew(const Piece& p)
+{
+    auto p_block = new PieceBlock;
+    block_Init(p_block, p.data.get() + p.offset, p.length);
+    p_block->pf_release = PieceBlockRelease;
+    p_block->buffer = p.data;
+    return p_block;
+}
+
+static void TraceRead(access_t* p_access, time_point start, uint64_t requested, int64_t returned)
+{
+    auto& trace = p_access->p_sys->trace;
+    if (trace.is_open())
+        trace.Read(start, p_access->info.i_pos, requested, returned);
+}
+
 static block_t* Block(access_t* p_access)
 {
     Piece p;
     bool eof;
 
+    const auto start = std::chrono::steady_clock::now();
     auto& torrent = p_access->p_sys->torrent;
-    torrent.ReadNextPiece(p, eof);
+    ReadNextPiece(p_access, p, eof, torrent.block_size() > 0 ? torrent.block_size() : whole_piece);
 
     p_access->info.b_eof = eof;
-    if (eof || p.data == nullptr)
+    if (eof || p.data == nullptr) {
+        TraceRead(p_access, start, torrent.block_size(), eof ? 0 : -1);
         return nullptr;
-    p_access->info.i_pos += p.length;
-    return p.data.release();
+    }
+
+    // Chain the following pieces already available, up to the block size.
+    // Pieces larger than the block size are handed out in slices, without copying them.
+    auto size = static_cast<uint64_t>(p.length);
+    auto chain = PieceBlockNew(p);
+    auto last = &chain->p_next;
+    while (size < torrent.block_size() && torrent.ReadReadyPiece(p, torrent.block_size() - size)) {
+        size += p.length;
+        block_ChainLastAppend(&last, PieceBlockNew(p));
+    }
+
+    TraceRead(p_access, start, torrent.block_size(), size);
+    p_access->info.i_pos += size;
+    return chain;
+}
+
+static ssize_t Read(access_t* p_access, uint8_t* p_buf, size_t i_len)
+{
+    Piece p;
+    bool eof;
+
+    if (i_len == 0)
+        return 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    auto& torrent = p_access->p_sys->torrent;
+    ReadNextPiece(p_access, p, eof, i_len);
+
+    p_access->info.b_eof = eof;
+    if (eof || p.data == nullptr) {
+        TraceRead(p_access, start, i_len, eof ? 0 : -1);
+        return eof ? 0 : -1;
+    }
+
+    // Copy the following pieces already available, up to the requested size.
+    auto size = size_t{0};
+    do {
+        std::memcpy(p_buf + size, p.data.get() + p.offset, p.length);
+        size += p.length;
+    } while (size < i_len && torrent.ReadReadyPiece(p, i_len - size));
+
+    TraceRead(p_access, start, i_len, size);
+    p_access->info.i_pos += size;
+    return size;
 }
 
 static int Seek(access_t *p_access, uint64_t i_pos)
 {
+    const auto start = std::chrono::steady_clock::now();
     auto& torrent = p_access->p_sys->torrent;
+    i_pos = std::min(i_pos, torrent.file_size());
     torrent.SelectPieces(i_pos);
     p_access->info.i_pos = i_pos;
+    p_access->info.b_eof = i_pos == torrent.file_size();
+    if (p_access->p_sys->trace.is_open())
+        p_access->p_sys->trace.Seek(start, i_pos);
     return VLC_SUCCESS;
 }
@@ -0,0 +1,227 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "engine.h"
+
+namespace bench {
+
+const int MemoryEngine::default_priority;
+
+MemoryEngine::MemoryEngine(int num_pieces, int piece_size, int pieces_per_poll) :
+    num_pieces_{num_pieces},
+    piece_size_{piece_size},
+    pieces_per_poll_{pieces_per_poll},
+    fill_{false},
+    added_{false},
+    state_{lts::checking_files},
+    state_changed_{false},
+    num_have_{0},
+    zeroes_{new char[piece_size]()}
+{}
+
+int MemoryEngine::AddTorrent(const lt::add_torrent_params& params)
+{
+    VLC_UNUSED(params);
+
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+
+    added_ = true;
+    state_ = lts::downloading;
+    state_changed_ = true;
+    num_have_ = 0;
+    have_.assign(num_pieces_, false);
+    priorities_.assign(num_pieces_, default_priority);
+    deadline_.assign(num_pieces_, false);
+    deadlines_.clear();
+    reads_.clear();
+    wanted_.clear();
+    for (auto i = 0; i < num_pieces_; ++i)
+        wanted_.emplace_hint(wanted_.end(), -default_priority, i);
+    return VLC_SUCCESS;
+}
+
+void MemoryEngine::RemoveTorrent(bool delete_files)
+{
+    VLC_UNUSED(delete_files);
+
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    added_ = false;
+}
+
+bool MemoryEngine::PopEvents(std::chrono::milliseconds timeout, std::vector<EngineEvent>& events)
+{
+    VLC_UNUSED(timeout);
+
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    const auto size = events.size();
+
+    if (!added_)
+        return false;
+
+    if (state_changed_) {
+        events.emplace_back(EngineEvent::state_changed);
+        events.back().state = state_;
+        state_changed_ = false;
+    }
+
+    for (auto n = 0; n < pieces_per_poll_; ++n) {
+        const auto piece = Pick();
+        if (piece < 0)
+            break;
+        Download(piece, events);
+    }
+
+    for (const auto piece : reads_) {
+        events.emplace_back(EngineEvent::read_piece, piece);
+        events.back().data = Read(piece);
+        events.back().size = piece_size_;
+    }
+    reads_.clear();
+
+    if (num_have_ == num_pieces_ && state_ != lts::seeding) {
+        state_ = lts::seeding;
+        events.emplace_back(EngineEvent::state_changed);
+        events.back().state = state_;
+    }
+    return events.size() > size;
+}
+
+int MemoryEngine::Pick()
+{
+    while (!deadlines_.empty()) {
+        const auto piece = deadlines_.front();
+        deadlines_.pop_front();
+        if (!have_[piece])
+            return piece;
+    }
+    if (wanted_.empty())
+        return -1;
+    return wanted_.begin()->second;
+}
+
+void MemoryEngine::Download(int piece, std::vector<EngineEvent>& events)
+{
+    have_[piece] = true;
+    ++num_have_;
+    wanted_.erase({-priorities_[piece], piece});
+    events.emplace_back(EngineEvent::piece_finished, piece);
+
+    if (deadline_[piece]) {
+        deadline_[piece] = false;
+        reads_.push_back(piece);
+    }
+}
+
+boost::shared_array<char> MemoryEngine::Read(int piece) const
+{
+    if (!fill_)
+        return zeroes_;
+
+    boost::shared_array<char> data{new char[piece_size_]};
+    const auto offset = static_cast<uint64_t>(piece) * piece_size_;
+    for (auto i = 0; i < piece_size_; ++i)
+        data[i] = Byte(offset + i);
+    return data;
+}
+
+void MemoryEngine::SetPriority(int piece, int priority)
+{
+    if (!have_[piece] && priorities_[piece] > 0)
+        wanted_.erase({-priorities_[piece], piece});
+    priorities_[piece] = priority;
+    if (!have_[piece] && priority > 0)
+        wanted_.emplace(-priority, piece);
+}
+
+void MemoryEngine::PrioritizePieces(const std::vector<int>& priorities)
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+
+    for (size_t i = 0; i < priorities.size(); ++i)
+        SetPriority(i, priorities[i]);
+}
+
+void MemoryEngine::SetPiecePriority(int piece, int priority)
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    SetPriority(piece, priority);
+}
+
+void MemoryEngine::SetPieceDeadline(int piece)
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+
+    // Like libtorrent, pieces we already have are read right away.
+    if (have_[piece])
+        reads_.push_back(piece);
+    else if (!deadline_[piece]) {
+        deadline_[piece] = true;
+        deadlines_.push_back(piece);
+    }
+}
+
+void MemoryEngine::ClearPieceDeadlines()
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+
+    for (const auto piece : deadlines_)
+        deadline_[piece] = false;
+    deadlines_.clear();
+}
+
+void MemoryEngine::ReadPiece(int piece)
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    reads_.push_back(piece);
+}
+
+void MemoryEngine::SetDownloadLimit(int rate)
+{
+    VLC_UNUSED(rate);
+}
+
+void MemoryEngine::ConnectPeer(const lt::tcp::endpoint& endpoint)
+{
+    VLC_UNUSED(endpoint);
+}
+
+bool MemoryEngine::has_torrent() const
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    return added_;
+}
+
+std::vector<bool> MemoryEngine::have_pieces() const
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    return have_;
+}
+
+EngineStatus MemoryEngine::status() const
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    return {state_, 0, 0, 0};
+}
+
+}
@@ -0,0 +1,99 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef BENCH_ENGINE_H
+#define BENCH_ENGINE_H
+
+#include <set>
+#include <deque>
+#include <vector>
+#include <mutex>
+
+#include "../torrent.h"
+
+namespace bench {
+
+// Deterministic in-memory engine for the benchmarks: there is no network nor disk, every call to
+// PopEvents() downloads a fixed number of pieces, deadlines first then by decreasing priority, the way
+// the libtorrent picker would with a perfect swarm, and returns the events right away.
+class MemoryEngine : public TorrentEngine
+{
+    public:
+        MemoryEngine(int num_pieces, int piece_size, int pieces_per_poll);
+
+        int AddTorrent(const lt::add_torrent_params& params) override;
+        void RemoveTorrent(bool delete_files) override;
+        bool PopEvents(std::chrono::milliseconds timeout, std::vector<EngineEvent>& events) override;
+        void PrioritizePieces(const std::vector<int>& priorities) override;
+        void SetPiecePriority(int piece, int priority) override;
+        void SetPieceDeadline(int piece) override;
+        void ClearPieceDeadlines() override;
+        void ReadPiece(int piece) override;
+        void SetDownloadLimit(int rate) override;
+        void ConnectPeer(const lt::tcp::endpoint& endpoint) override;
+
+        bool has_torrent() const override;
+        std::vector<bool> have_pieces() const override;
+        EngineStatus status() const override;
+
+        // Content of the torrent when filled, otherwise every piece shares the same zeroed buffer.
+        static char Byte(uint64_t offset);
+        void set_fill(bool fill);
+
+    private:
+        static const auto default_priority = 4;
+
+        int Pick();
+        void Download(int piece, std::vector<EngineEvent>& events);
+        void SetPriority(int piece, int priority);
+        boost::shared_array<char> Read(int piece) const;
+
+        int                           num_pieces_;
+        int                           piece_size_;
+        int                           pieces_per_poll_;
+        bool                          fill_;
+        mutable std::mutex            mutex_;
+        bool                          added_;
+        lts::state_t                  state_;
+        bool                          state_changed_;
+        int                           num_have_;
+        std::vector<bool>             have_;
+        std::vector<int>              priorities_;
+        std::set<std::pair<int, int>> wanted_;    // Missing pieces to download, as (-priority, piece).
+        std::vector<bool>             deadline_;
+        std::deque<int>               deadlines_; // In the order they were set.
+        std::deque<int>               reads_;
+        boost::shared_array<char>     zeroes_;
+};
+
+inline void MemoryEngine::set_fill(bool fill)
+{
+    fill_ = fill;
+}
+
+inline char MemoryEngine::Byte(uint64_t offset)
+{
+    // A prime period never lines up with the pieces, so slices handed out at the wrong offset show.
+    return static_cast<char>(offset % 251);
+}
+
+}
+
+#endif
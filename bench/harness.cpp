@@ -0,0 +1,721 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <vlc/vlc.h>
+#include <vlc_common.h>
+#include <vlc_fs.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#undef poll // XXX boost redefines poll inside libtorrent headers
+
+#include <libtorrent/create_torrent.hpp>
+#include <libtorrent/bencode.hpp>
+#if LIBTORRENT_VERSION_NUM >= 10100
+# include <libtorrent/fingerprint.hpp>
+# include <libtorrent/ip_filter.hpp>
+#endif
+
+#include "libvlc_internal.h" // In the lib/ directory of the VLC tree.
+
+#include "harness.h"
+
+namespace bench {
+
+static const auto read_timeout = std::chrono::milliseconds{100}; // Same as the access Block/Read callbacks.
+static const auto relay_chunk_size = 64 * 1024;
+static const auto relay_max_queued = 4 * 1024 * 1024;            // Bytes in flight per direction before reads are paused.
+
+seconds CpuTime()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    const auto tv = [](const struct timeval& t) {
+        return seconds{t.tv_sec + t.tv_usec / 1e6};
+    };
+    return tv(usage.ru_utime) + tv(usage.ru_stime);
+}
+
+bool ParseSize(const std::string& s, uint64_t& size)
+{
+    char* end;
+
+    size = strtoull(s.c_str(), &end, 10);
+    const auto unit = std::string{"KMG"}.find(*end);
+    if (*end != '\0' && unit != std::string::npos) {
+        size <<= 10 * (unit + 1);
+        ++end;
+    }
+    return end != s.c_str() && *end == '\0';
+}
+
+bool ParseScript(const std::string& script, std::vector<Step>& steps)
+{
+    std::istringstream in{script};
+    std::string text;
+
+    while (std::getline(in, text, ',')) {
+        Step step{Step::play, 0, false, text};
+
+        const auto sep = text.find(':');
+        if (sep == std::string::npos)
+            return false;
+        const auto verb = text.substr(0, sep);
+        auto arg = text.substr(sep + 1);
+        if (verb == "seek")
+            step.type = Step::seek;
+        else if (verb != "play")
+            return false;
+        if (step.type == Step::seek && !arg.empty() && arg.back() == '%') {
+            step.percent = true;
+            arg.pop_back();
+        }
+        if (!ParseSize(arg, step.value))
+            return false;
+        steps.push_back(step);
+    }
+    return !steps.empty();
+}
+
+/*****************************************************************************
+ * TempDir
+ *****************************************************************************/
+
+TempDir::TempDir()
+{
+    auto tmpl = std::string{P_tmpdir "/vlc-torrent-bench-XXXXXX"};
+    if (mkdtemp(&tmpl[0]) == nullptr)
+        throw std::runtime_error{"could not create a temporary directory"};
+    path_ = tmpl;
+}
+
+TempDir::~TempDir()
+{
+    nftw(path_.c_str(), [](const char* path, const struct stat*, int, struct FTW*) {
+        return remove(path);
+    }, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+std::string TempDir::Sub(const std::string& name) const
+{
+    const auto path = path_ + "/" + name;
+    vlc_mkdir(path.c_str(), 0700);
+    return path;
+}
+
+/*****************************************************************************
+ * SyntheticTorrent
+ *****************************************************************************/
+
+SyntheticTorrent CreateTorrent(const std::string& dir, uint64_t size, int piece_size)
+{
+    lt::error_code ec;
+    lt::file_storage fs;
+
+    SyntheticTorrent torrent{dir, dir + "/synthetic.bin", dir + "/synthetic.torrent", size, piece_size};
+
+    // Random content so that every piece hashes differently.
+    std::ofstream file{torrent.file_path, std::ios_base::binary};
+    std::mt19937_64 rand{size};
+    std::vector<uint64_t> chunk(1024 * 1024 / sizeof(uint64_t));
+    for (uint64_t n = 0; n < size; n += chunk.size() * sizeof(uint64_t)) {
+        std::generate(std::begin(chunk), std::end(chunk), std::ref(rand));
+        file.write(reinterpret_cast<const char*>(chunk.data()),
+                   std::min<uint64_t>(size - n, chunk.size() * sizeof(uint64_t)));
+    }
+    file.close();
+    if (!file)
+        throw std::runtime_error{"could not write " + torrent.file_path};
+
+    lt::add_files(fs, torrent.file_path);
+    lt::create_torrent t{fs, piece_size};
+    lt::set_piece_hashes(t, dir, ec);
+    if (ec)
+        throw std::runtime_error{"could not hash " + torrent.file_path + ": " + ec.message()};
+
+    std::ofstream out{torrent.torrent_path, std::ios_base::binary};
+    lt::bencode(std::ostream_iterator<char>{out}, t.generate());
+    out.close();
+    if (!out)
+        throw std::runtime_error{"could not write " + torrent.torrent_path};
+    return torrent;
+}
+
+/*****************************************************************************
+ * Seeder
+ *****************************************************************************/
+
+#if LIBTORRENT_VERSION_NUM >= 10100
+static lt::settings_pack SeederSettings(int upload_rate_limit)
+{
+    lt::settings_pack s;
+
+    s.set_str(lt::settings_pack::peer_fingerprint, lt::generate_fingerprint("VB", 0));
+    s.set_str(lt::settings_pack::listen_interfaces, "127.0.0.1:0");
+    s.set_int(lt::settings_pack::upload_rate_limit, upload_rate_limit * 1024);
+    s.set_bool(lt::settings_pack::allow_multiple_connections_per_ip, true);
+    s.set_bool(lt::settings_pack::enable_dht, false);
+    s.set_bool(lt::settings_pack::enable_lsd, false);
+    s.set_bool(lt::settings_pack::enable_upnp, false);
+    s.set_bool(lt::settings_pack::enable_natpmp, false);
+    return s;
+}
+
+Seeder::Seeder(const SyntheticTorrent& torrent, int upload_rate_limit) :
+    session_{SeederSettings(upload_rate_limit)}
+{
+    lt::error_code ec;
+    lt::add_torrent_params params;
+    lt::ip_filter filter;
+
+    // Peers on the loopback are exempt from rate limits by default, put every peer in the global class.
+    filter.add_rule(lt::address_v4::from_string("0.0.0.0"), lt::address_v4::from_string("255.255.255.255"),
+                    1 << static_cast<std::uint32_t>(lt::session::global_peer_class_id));
+    session_.set_peer_class_filter(filter);
+#else
+Seeder::Seeder(const SyntheticTorrent& torrent, int upload_rate_limit) :
+    session_{lt::fingerprint{"VB", 0, 0, 0, 0}, std::make_pair(49152, 65535), "127.0.0.1", 0}
+{
+    lt::error_code ec;
+    lt::add_torrent_params params;
+
+    auto settings = session_.settings();
+    settings.upload_rate_limit = upload_rate_limit * 1024;
+    settings.ignore_limits_on_local_network = false;
+    settings.allow_multiple_connections_per_ip = true;
+    session_.set_settings(settings);
+#endif
+
+    params.ti.reset(new lt::torrent_info{torrent.torrent_path, ec});
+    if (ec)
+        throw std::runtime_error{"could not load " + torrent.torrent_path + ": " + ec.message()};
+    params.save_path = torrent.dir;
+    // Neither paused nor auto managed, seed right away.
+#if LIBTORRENT_VERSION_NUM >= 10200
+    params.flags = lt::torrent_flags::seed_mode;
+#else
+    params.flags = lt::add_torrent_params::flag_seed_mode;
+#endif
+    handle_ = session_.add_torrent(params, ec);
+    if (ec)
+        throw std::runtime_error{"could not seed " + torrent.torrent_path + ": " + ec.message()};
+}
+
+unsigned short Seeder::port() const
+{
+    return session_.listen_port();
+}
+
+lt::session& Seeder::session()
+{
+    return session_;
+}
+
+/*****************************************************************************
+ * Relay
+ *****************************************************************************/
+
+Relay::Relay(const std::string& address, unsigned short upstream, std::chrono::milliseconds rtt) :
+    address_{address},
+    upstream_{upstream},
+    delay_{std::chrono::duration_cast<clock::duration>(rtt) / 2},
+    fd_{socket(AF_INET, SOCK_STREAM, 0)},
+    port_{0},
+    drop_{false},
+    stopped_{false}
+{
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+
+    addr.sin_family = AF_INET;
+    if (fd_ < 0 || inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        bind(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd_, 16) < 0 ||
+        getsockname(fd_, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0) {
+        if (fd_ >= 0)
+            close(fd_);
+        throw std::runtime_error{"could not listen on " + address};
+    }
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread{&Relay::Run, this};
+}
+
+Relay::~Relay()
+{
+    stopped_ = true;
+    thread_.join();
+    for (const auto& c : connections_) {
+        close(c.fds[0]);
+        close(c.fds[1]);
+    }
+    close(fd_);
+}
+
+void Relay::Drop(seconds downtime)
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    down_until_ = clock::now() + std::chrono::duration_cast<clock::duration>(downtime);
+    drop_ = true;
+}
+
+bool Relay::up() const
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    return clock::now() >= down_until_;
+}
+
+void Relay::Run()
+{
+    using namespace std::chrono;
+
+    std::vector<struct pollfd> ufds;
+
+    while (!stopped_) {
+        auto drop = false;
+        auto down_until = clock::time_point{};
+        {
+            const auto lock = std::unique_lock<std::mutex>{mutex_};
+            std::swap(drop, drop_);
+            down_until = down_until_;
+        }
+        if (drop) {
+            // Everything in flight is lost, most likely in the middle of a piece.
+            for (const auto& c : connections_) {
+                close(c.fds[0]);
+                close(c.fds[1]);
+            }
+            connections_.clear();
+        }
+
+        auto now = clock::now();
+        auto timeout = clock::duration{milliseconds{50}};
+        ufds.assign(1, {fd_, POLLIN, 0});
+        for (const auto& c : connections_) {
+            for (auto i = 0; i < 2; ++i) {
+                short events = 0;
+                if (c.queues[1 - i].size() * relay_chunk_size < relay_max_queued)
+                    events |= POLLIN;
+                if (!c.queues[i].empty()) {
+                    if (c.queues[i].front().due <= now)
+                        events |= POLLOUT;
+                    else
+                        timeout = std::min(timeout, c.queues[i].front().due - now);
+                }
+                ufds.push_back({c.fds[i], events, 0});
+            }
+        }
+        if (poll(ufds.data(), ufds.size(), duration_cast<milliseconds>(timeout).count() + 1) < 0 && errno != EINTR)
+            break;
+
+        now = clock::now();
+        auto ufd = std::next(std::begin(ufds));
+        for (auto c = std::begin(connections_); c != std::end(connections_); ufd += 2) {
+            auto ok = true;
+            for (auto i = 0; i < 2 && ok; ++i) {
+                if (ufd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    ok = Forward(*c, i, now);
+                if (ok)
+                    ok = Flush(*c, i, now);
+            }
+            if (ok)
+                ++c;
+            else {
+                close(c->fds[0]);
+                close(c->fds[1]);
+                c = connections_.erase(c);
+            }
+        }
+        if (ufds[0].revents & POLLIN)
+            Accept(now < down_until);
+    }
+}
+
+void Relay::Accept(bool refuse)
+{
+    struct sockaddr_in addr = {};
+
+    const auto peer = accept(fd_, nullptr, nullptr);
+    if (peer < 0)
+        return;
+    if (refuse) {
+        close(peer);
+        return;
+    }
+
+    const auto seeder = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(upstream_);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (seeder < 0 || connect(seeder, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        if (seeder >= 0)
+            close(seeder);
+        close(peer);
+        return;
+    }
+
+    const auto nodelay = 1;
+    for (const auto fd : {peer, seeder}) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    connections_.push_back({{peer, seeder}, {}});
+}
+
+bool Relay::Forward(Connection& c, int from, clock::time_point now)
+{
+    char buf[relay_chunk_size];
+
+    const auto n = recv(c.fds[from], buf, sizeof(buf), 0);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (n == 0)
+        return false;
+    c.queues[1 - from].push_back({now + delay_, {buf, buf + n}});
+    return true;
+}
+
+bool Relay::Flush(Connection& c, int to, clock::time_point now)
+{
+    auto& queue = c.queues[to];
+
+    while (!queue.empty() && queue.front().due <= now) {
+        auto& data = queue.front().data;
+        const auto n = send(c.fds[to], data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (static_cast<size_t>(n) < data.size()) {
+            data.erase(std::begin(data), std::begin(data) + n);
+            break;
+        }
+        queue.pop_front();
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * Vlc
+ *****************************************************************************/
+
+Vlc::Vlc(const std::string& cache_dir, bool verbose)
+{
+    // Keep the torrents, resume data and DHT state of the benchmark away from the user cache.
+    setenv("XDG_CACHE_HOME", cache_dir.c_str(), 1);
+
+    const char* argv[] = {"--ignore-config", verbose ? "--verbose=2" : "--quiet"};
+    instance_ = libvlc_new(sizeof(argv) / sizeof(*argv), argv);
+    if (instance_ == nullptr)
+        throw std::runtime_error{"could not create the libvlc instance"};
+}
+
+Vlc::~Vlc()
+{
+    libvlc_release(instance_);
+}
+
+access_t* Vlc::CreateAccess(const std::string& location, const Options& options)
+{
+    auto access = static_cast<access_t*>(vlc_object_create(instance_->p_libvlc_int, sizeof(access_t)));
+    if (access == nullptr)
+        throw std::bad_alloc{};
+    access->psz_location = strdup(location.c_str());
+
+    // The module may not be loaded, so every option TorrentAccess inherits is created on the access itself.
+    const auto set_integer = [access](const char* name, int64_t value) {
+        var_Create(access, name, VLC_VAR_INTEGER);
+        var_SetInteger(access, name, value);
+    };
+    var_Create(access, "keep-files", VLC_VAR_BOOL);
+    var_SetBool(access, "keep-files", false);
+    var_Create(access, "share-ratio-limit", VLC_VAR_FLOAT);
+    var_SetFloat(access, "share-ratio-limit", 2.f);
+    var_Create(access, "user-agent", VLC_VAR_STRING);
+    var_SetString(access, "user-agent", "vlc-torrent-bench");
+    set_integer("upload-rate-limit", 0);
+    set_integer("download-rate-limit", options.download_rate_limit);
+    set_integer("torrent-block-size", options.block_size);
+    set_integer("piece-cache-size", options.piece_cache_size);
+    set_integer("pause-buffer-size", options.pause_buffer_size);
+    set_integer("pause-download-rate-limit", 0);
+    set_integer("background-download-threshold", options.background_threshold);
+    var_Create(access, "torrent-profile", VLC_VAR_STRING);
+    var_SetString(access, "torrent-profile", options.profile.c_str());
+    if (!options.stats_file.empty()) {
+        var_Create(access, "torrent-stats-file", VLC_VAR_STRING);
+        var_SetString(access, "torrent-stats-file", options.stats_file.c_str());
+    }
+    return access;
+}
+
+void Vlc::ReleaseAccess(access_t* access)
+{
+    free(access->psz_location);
+    vlc_object_release(access);
+}
+
+/*****************************************************************************
+ * Streamer
+ *****************************************************************************/
+
+Streamer::Streamer(Vlc& vlc, const SyntheticTorrent& torrent, const std::string& download_dir,
+                   const Options& options) :
+    vlc_(vlc),
+    torrent_(torrent),
+    download_dir_{download_dir},
+    access_{vlc.CreateAccess(torrent.torrent_path, options)},
+    position_{0},
+    verify_{false},
+    fd_{vlc_open(torrent.file_path.c_str(), O_RDONLY)}
+{
+    access_torrent_.reset(new TorrentAccess{access_});
+}
+
+Streamer::~Streamer()
+{
+    access_torrent_.reset();
+    vlc_.ReleaseAccess(access_);
+    if (fd_ >= 0)
+        vlc_close(fd_);
+}
+
+int Streamer::Start()
+{
+    lt::add_torrent_params params;
+
+    if (TorrentAccess::ParseURI(torrent_.torrent_path, params) != VLC_SUCCESS)
+        return VLC_EGENERIC;
+    access_torrent_->set_parameters(std::move(params));
+    access_torrent_->set_download_dir({strdup(download_dir_.c_str()), std::free});
+    return access_torrent_->StartDownload(0);
+}
+
+void Streamer::AddPeer(const std::string& address, unsigned short port)
+{
+    access_torrent_->AddPeer({lt::address_v4::from_string(address), port});
+}
+
+bool Streamer::ReadPiece(Piece& p, uint64_t max_length, int& stalls)
+{
+    using namespace std::chrono;
+
+    bool eof = false;
+
+    const auto block_size = access_torrent_->block_size();
+    if (block_size > 0)
+        max_length = std::min(block_size, max_length);
+    for (;;) {
+        access_torrent_->ReadNextPiece(p, eof, max_length);
+        if (eof || p.data != nullptr)
+            break;
+
+        // Same wait as the access callbacks, minus the interruption.
+        const auto wait_start = clock::now();
+        ++stalls;
+        access_torrent_->WaitReady(read_timeout);
+        access_torrent_->CountRead(duration_cast<microseconds>(clock::now() - wait_start), true);
+    }
+    if (p.data == nullptr)
+        return false;
+
+    if (verify_ && !Verify(p))
+        throw std::runtime_error{"corrupted data at offset " + std::to_string(position_)};
+    position_ += p.length;
+    return true;
+}
+
+ReadStats Streamer::Read(uint64_t size)
+{
+    ReadStats stats;
+
+    const auto start = clock::now();
+    while (stats.bytes < size) {
+        Piece p;
+        if (!ReadPiece(p, size - stats.bytes, stats.stalls))
+            break;
+        if (stats.bytes == 0)
+            stats.first_byte = clock::now() - start;
+        stats.bytes += p.length;
+    }
+    stats.elapsed = clock::now() - start;
+    return stats;
+}
+
+// Reads like a player would: the buffer is filled before the playback starts, then the data is consumed
+// at the given bitrate (bytes/s) without reading further ahead than the buffer. Whenever a block arrives
+// after the time it should have been played, the playback is stalled until then.
+PlaybackStats Streamer::Play(uint64_t size, uint64_t bitrate, seconds buffer)
+{
+    PlaybackStats stats;
+
+    const auto buffer_size = static_cast<uint64_t>(buffer.count() * bitrate);
+    const auto start = clock::now();
+    auto playback_start = clock::time_point{};
+    auto started = false;
+
+    const auto due = [&](uint64_t offset) {
+        return playback_start + std::chrono::duration_cast<clock::duration>(seconds{double(offset) / bitrate});
+    };
+
+    while (stats.bytes < size) {
+        Piece p;
+
+        if (started && stats.bytes > buffer_size)
+            std::this_thread::sleep_until(due(stats.bytes - buffer_size));
+        if (!ReadPiece(p, size - stats.bytes, stats.stalls))
+            break;
+
+        const auto now = clock::now();
+        if (started && now > due(stats.bytes)) {
+            ++stats.rebuffers;
+            stats.rebuffer_time += now - due(stats.bytes);
+            playback_start += now - due(stats.bytes);
+        }
+        stats.bytes += p.length;
+        if (!started && stats.bytes >= std::min(buffer_size, size)) {
+            started = true;
+            playback_start = now;
+            stats.startup = now - start;
+        }
+    }
+    stats.elapsed = clock::now() - start;
+    if (!started)
+        stats.startup = stats.elapsed;
+    return stats;
+}
+
+void Streamer::Seek(uint64_t offset)
+{
+    position_ = std::min(offset, torrent_.size);
+    access_torrent_->SelectPieces(position_);
+}
+
+bool Streamer::Verify(const Piece& piece) const
+{
+    std::vector<char> expected(piece.length);
+
+    if (fd_ < 0 || pread(fd_, expected.data(), expected.size(), position_) != static_cast<ssize_t>(expected.size()))
+        return false;
+    return !memcmp(expected.data(), piece.data.get() + piece.offset, expected.size());
+}
+
+/*****************************************************************************
+ * Swarm
+ *****************************************************************************/
+
+Swarm::Swarm(const SyntheticTorrent& torrent, const SwarmOptions& options) :
+    options_(options),
+    stopped_{false},
+    disconnections_{0}
+{
+    for (auto i = 0; i < options_.seeders; ++i) {
+        const auto rate = options_.upload_rates[i % options_.upload_rates.size()];
+        const auto latency = options_.latencies[i % options_.latencies.size()];
+
+        // Every relay gets its own loopback address, for the downloader to see as many distinct peers.
+        seeders_.emplace_back(new Seeder{torrent, rate});
+        relays_.emplace_back(new Relay{"127.0.1." + std::to_string(i + 1), seeders_.back()->port(),
+                                       std::chrono::milliseconds{latency}});
+    }
+}
+
+Swarm::~Swarm()
+{
+    Leave();
+}
+
+void Swarm::Join(Streamer& streamer)
+{
+    Leave();
+    stopped_ = false;
+    thread_ = std::thread{&Swarm::Run, this, std::ref(streamer)};
+}
+
+void Swarm::Leave()
+{
+    {
+        const auto lock = std::unique_lock<std::mutex>{mutex_};
+        stopped_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void Swarm::Run(Streamer& streamer)
+{
+    std::mt19937 rand{options_.seed};
+    std::exponential_distribution<double> interval{options_.churn.count() > 0 ? 1 / options_.churn.count() : 1};
+
+    const auto next = [&] {
+        return clock::now() + std::chrono::duration_cast<clock::duration>(seconds{interval(rand)});
+    };
+
+    auto next_drop = next();
+    auto lock = std::unique_lock<std::mutex>{mutex_};
+    while (!stopped_) {
+        // Peers coming back are announced again, the way trackers and the DHT would.
+        for (const auto& r : relays_) {
+            if (r->up())
+                streamer.AddPeer(r->address(), r->port());
+        }
+
+        if (options_.churn.count() > 0 && clock::now() >= next_drop) {
+            std::vector<Relay*> up;
+            for (const auto& r : relays_) {
+                if (r->up())
+                    up.push_back(r.get());
+            }
+            if (!up.empty()) {
+                up[std::uniform_int_distribution<size_t>{0, up.size() - 1}(rand)]->Drop(options_.downtime);
+                ++disconnections_;
+            }
+            next_drop = next();
+        }
+
+        auto wake = clock::now() + std::chrono::seconds{1};
+        if (options_.churn.count() > 0)
+            wake = std::min(wake, next_drop);
+        cond_.wait_until(lock, wake);
+    }
+}
+
+}
@@ -0,0 +1,292 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "../torrent.h"
+
+struct libvlc_instance_t;
+
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+using seconds = std::chrono::duration<double>;
+
+// Process CPU time (user + system) spent so far, every session of the benchmark included.
+seconds CpuTime();
+
+// Step of a benchmark script, e.g. "play:32M" or "seek:50%".
+struct Step
+{
+    enum { play, seek } type;
+    uint64_t            value;
+    bool                percent;
+    std::string         text;
+};
+
+bool ParseSize(const std::string& s, uint64_t& size);
+bool ParseScript(const std::string& script, std::vector<Step>& steps);
+
+// Temporary directory, removed along with its content on destruction.
+class TempDir
+{
+    public:
+        TempDir();
+        ~TempDir();
+
+        std::string Sub(const std::string& name) const;
+
+        const std::string& path() const;
+
+    private:
+        std::string path_;
+};
+
+// Torrent of a single file filled with random data.
+struct SyntheticTorrent
+{
+    std::string dir;          // Directory containing the file, i.e. where it is seeded from.
+    std::string file_path;
+    std::string torrent_path;
+    uint64_t    size;
+    int         piece_size;
+};
+
+SyntheticTorrent CreateTorrent(const std::string& dir, uint64_t size, int piece_size);
+
+// Second libtorrent session seeding a synthetic torrent on localhost.
+class Seeder
+{
+    public:
+        Seeder(const SyntheticTorrent& torrent, int upload_rate_limit = 0);
+
+        unsigned short port() const;
+        lt::session& session();
+
+    private:
+        lt::session        session_;
+        lt::torrent_handle handle_;
+};
+
+// TCP relay on a loopback address in front of a seeder, delaying the traffic and dropping the
+// connections on demand to make the seeder behave like a remote and unreliable peer.
+class Relay
+{
+    public:
+        Relay(const std::string& address, unsigned short upstream, std::chrono::milliseconds rtt);
+        ~Relay();
+
+        void Drop(seconds downtime);
+
+        bool up() const;
+        const std::string& address() const;
+        unsigned short port() const;
+
+    private:
+        struct Chunk
+        {
+            clock::time_point due;
+            std::vector<char> data;
+        };
+        struct Connection
+        {
+            int               fds[2];    // Accepted peer, seeder.
+            std::deque<Chunk> queues[2]; // Data to be written to the peer, to the seeder.
+        };
+
+        void Run();
+        void Accept(bool refuse);
+        bool Forward(Connection& c, int from, clock::time_point now);
+        bool Flush(Connection& c, int to, clock::time_point now);
+
+        std::string           address_;
+        unsigned short        upstream_;
+        clock::duration       delay_; // One way.
+        int                   fd_;
+        unsigned short        port_;
+        mutable std::mutex    mutex_;
+        clock::time_point     down_until_;
+        bool                  drop_;
+        std::atomic_bool      stopped_;
+        std::list<Connection> connections_;
+        std::thread           thread_;
+};
+
+// Access module options, mirroring the module defaults unless overridden.
+struct Options
+{
+    int         block_size = 0;            // kB
+    int         piece_cache_size = 16;     // MiB
+    int         pause_buffer_size = 64;    // MiB
+    int         background_threshold = 20; // s
+    int         download_rate_limit = 0;   // kB/s
+    std::string profile = "desktop";
+    std::string stats_file;
+};
+
+// libvlc instance the access objects are attached to.
+class Vlc
+{
+    public:
+        Vlc(const std::string& cache_dir, bool verbose);
+        ~Vlc();
+
+        access_t* CreateAccess(const std::string& location, const Options& options);
+        void ReleaseAccess(access_t* access);
+
+    private:
+        libvlc_instance_t* instance_;
+};
+
+struct ReadStats
+{
+    uint64_t bytes = 0;
+    int      stalls = 0;    // Reads which had to wait for a piece.
+    seconds  first_byte{0}; // Time until the first byte was read.
+    seconds  elapsed{0};
+};
+
+struct PlaybackStats
+{
+    uint64_t bytes = 0;
+    int      stalls = 0;
+    int      rebuffers = 0;    // Times the playback ran out of data.
+    seconds  startup{0};       // Time until the buffer was filled and the playback started.
+    seconds  rebuffer_time{0}; // Time the playback spent waiting for data once started.
+    seconds  elapsed{0};
+};
+
+// Downloads a synthetic torrent through TorrentAccess, reading it the way the access callbacks do.
+class Streamer
+{
+    public:
+        Streamer(Vlc& vlc, const SyntheticTorrent& torrent, const std::string& download_dir,
+                 const Options& options);
+        ~Streamer();
+
+        int Start();
+        void AddPeer(const std::string& address, unsigned short port);
+        ReadStats Read(uint64_t size);
+        PlaybackStats Play(uint64_t size, uint64_t bitrate, seconds buffer);
+        void Seek(uint64_t offset);
+        bool Verify(const Piece& piece) const;
+
+        uint64_t position() const;
+        uint64_t size() const;
+        void set_verify(bool verify);
+
+    private:
+        bool ReadPiece(Piece& piece, uint64_t max_length, int& stalls);
+
+        Vlc&                           vlc_;
+        const SyntheticTorrent&        torrent_;
+        std::string                    download_dir_;
+        access_t*                      access_;
+        std::unique_ptr<TorrentAccess> access_torrent_;
+        uint64_t                       position_;
+        bool                           verify_;
+        int                            fd_;
+};
+
+// Seeders behind relays with their own bandwidth and latency, some of them leaving and coming back.
+struct SwarmOptions
+{
+    int              seeders = 4;
+    std::vector<int> upload_rates{0}; // kB/s, cycled over the seeders (0=unlimited)
+    std::vector<int> latencies{0};    // ms round trip time, cycled over the seeders
+    seconds          churn{0};        // Mean time between two disconnections (0=none)
+    seconds          downtime{5};     // Time a disconnected seeder stays unreachable
+    unsigned         seed = 0;
+};
+
+class Swarm
+{
+    public:
+        Swarm(const SyntheticTorrent& torrent, const SwarmOptions& options);
+        ~Swarm();
+
+        void Join(Streamer& streamer);
+        void Leave();
+
+        int disconnections() const;
+
+    private:
+        void Run(Streamer& streamer);
+
+        SwarmOptions                         options_;
+        std::vector<std::unique_ptr<Seeder>> seeders_;
+        std::vector<std::unique_ptr<Relay>>  relays_;
+        std::mutex                           mutex_;
+        std::condition_variable              cond_;
+        bool                                 stopped_;
+        std::atomic<int>                     disconnections_;
+        std::thread                          thread_;
+};
+
+inline const std::string& TempDir::path() const
+{
+    return path_;
+}
+
+inline uint64_t Streamer::position() const
+{
+    return position_;
+}
+
+inline uint64_t Streamer::size() const
+{
+    return torrent_.size;
+}
+
+inline void Streamer::set_verify(bool verify)
+{
+    verify_ = verify;
+}
+
+inline const std::string& Relay::address() const
+{
+    return address_;
+}
+
+inline unsigned short Relay::port() const
+{
+    return port_;
+}
+
+inline int Swarm::disconnections() const
+{
+    return disconnections_;
+}
+
+}
+
+#endif
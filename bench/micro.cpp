@@ -0,0 +1,445 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Micro-benchmarks of the piece scheduling and delivery hot paths, without any networking.
+// Every benchmark runs for an increasing number of iterations until it lasts long enough,
+// and reports the time per iteration, the way Google Benchmark does. SelectPieces, HandleReadPiece
+// ReadNextPieceHandoff and StreamPieces run PieceStreamer itself against the in-memory engine.
+//
+// Usage: torrent-bench-micro [--filter=SUBSTRING] [--min-time=S] [--verify]
+//   --verify              fill the in-memory torrent and check every byte StreamPieces reads
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <stdexcept>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <getopt.h>
+
+#include "harness.h"
+#include "engine.h"
+
+using clock_type = std::chrono::steady_clock;
+
+class State
+{
+    public:
+        State(int64_t range, uint64_t iterations) :
+            range_{range},
+            iterations_{iterations},
+            done_{0},
+            paused_{0}
+        {}
+
+        bool KeepRunning()
+        {
+            if (done_ == 0)
+                start_ = clock_type::now();
+            if (done_++ < iterations_)
+                return true;
+            elapsed_ = clock_type::now() - start_ - paused_;
+            return false;
+        }
+
+        // Excludes the setup of an iteration from the measure.
+        void PauseTiming() { pause_start_ = clock_type::now(); }
+        void ResumeTiming() { paused_ += clock_type::now() - pause_start_; }
+
+        int64_t range() const { return range_; }
+        uint64_t iterations() const { return iterations_; }
+        clock_type::duration elapsed() const { return elapsed_; }
+
+    private:
+        int64_t                range_;
+        uint64_t               iterations_;
+        uint64_t               done_;
+        clock_type::time_point start_;
+        clock_type::time_point pause_start_;
+        clock_type::duration   paused_;
+        clock_type::duration   elapsed_;
+};
+
+template <typename T>
+static void DoNotOptimize(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+static const auto piece_counts = {1 << 10, 1 << 14, 1 << 17, 1 << 20};
+static const auto queue_lengths = {16, 256, 4096, 65536};
+static const auto playhead_pieces = 8;
+static const auto prefetch_pieces = 2;
+
+static void PrepareHalfDownloaded(PiecePriorities& priorities, int num_pieces, std::mt19937& rand)
+{
+    priorities.Reset(num_pieces, 0, num_pieces - 1, playhead_pieces, prefetch_pieces);
+    for (auto i = 0; i < num_pieces; ++i) {
+        if (rand() % 2)
+            priorities.SetHave(i);
+    }
+    std::vector<int> changed;
+    priorities.Update(changed);
+}
+
+static const auto stream_piece_size = 16 * 1024;
+static const auto stream_pieces_per_poll = 4;
+static auto verify_stream = false; // Check every byte StreamPieces reads (--verify).
+
+// PieceStreamer started on a file of the given number of pieces, downloaded by the in-memory engine.
+class StreamerFixture
+{
+    public:
+        explicit StreamerFixture(int num_pieces, bool fill = false);
+        ~StreamerFixture();
+
+        void Restart();
+        bool Poll();
+        void SetHalfDownloaded(std::mt19937& rand);
+
+        PieceStreamer& streamer() { return *streamer_; }
+
+    private:
+        static bench::Vlc& vlc();
+
+        int                                  num_pieces_;
+        bool                                 fill_;
+        access_t*                            access_;
+        std::unique_ptr<bench::MemoryEngine> engine_;
+        std::unique_ptr<PieceStreamer>       streamer_;
+        std::vector<EngineEvent>             events_;
+};
+
+StreamerFixture::StreamerFixture(int num_pieces, bool fill) :
+    num_pieces_{num_pieces},
+    fill_{fill},
+    access_{vlc().CreateAccess("bench", bench::Options{})}
+{
+    Restart();
+}
+
+StreamerFixture::~StreamerFixture()
+{
+    streamer_.reset();
+    vlc().ReleaseAccess(access_);
+}
+
+bench::Vlc& StreamerFixture::vlc()
+{
+    static bench::TempDir tmp;
+    static bench::Vlc vlc{tmp.Sub("cache"), false};
+    return vlc;
+}
+
+void StreamerFixture::Restart()
+{
+    const auto size = static_cast<uint64_t>(num_pieces_) * stream_piece_size;
+
+    streamer_.reset();
+    engine_.reset(new bench::MemoryEngine{num_pieces_, stream_piece_size, stream_pieces_per_poll});
+    engine_->set_fill(fill_);
+    engine_->AddTorrent(lt::add_torrent_params{});
+    streamer_.reset(new PieceStreamer{VLC_OBJECT(access_), *engine_});
+    if (streamer_->Start({num_pieces_, stream_piece_size, 0, size}) != VLC_SUCCESS)
+        throw std::runtime_error{"could not start streaming"};
+}
+
+// Hands the engine events over to the streamer, the way the access alert thread does.
+bool StreamerFixture::Poll()
+{
+    events_.clear();
+    engine_->PopEvents(std::chrono::milliseconds{0}, events_);
+    for (const auto& e : events_)
+        streamer_->HandleEvent(e);
+    return !events_.empty();
+}
+
+// Random half of the pieces found on disk, as after resuming a torrent.
+void StreamerFixture::SetHalfDownloaded(std::mt19937& rand)
+{
+    EngineEvent event{EngineEvent::torrent_checked};
+    event.pieces.resize(num_pieces_);
+    for (auto i = 0; i < num_pieces_; ++i)
+        event.pieces[i] = rand() % 2;
+    streamer_->HandleEvent(event);
+}
+
+// First SelectPieces() of a torrent: priorities computed from scratch.
+static void BM_PrioritiesReset(State& state)
+{
+    std::vector<int> changed;
+    PiecePriorities priorities;
+
+    const auto n = static_cast<int>(state.range());
+    while (state.KeepRunning()) {
+        priorities.Reset(n, 0, n - 1, playhead_pieces, prefetch_pieces);
+        changed.clear();
+        priorities.Update(changed);
+        DoNotOptimize(changed);
+    }
+}
+
+// SelectPieces() on a seek, half of the file downloaded: queue rebuilt and priorities moved.
+static void BM_SelectPieces(State& state)
+{
+    std::mt19937 rand{0};
+
+    const auto n = static_cast<int>(state.range());
+    StreamerFixture fixture{n};
+    fixture.SetHalfDownloaded(rand);
+    while (state.KeepRunning())
+        fixture.streamer().SelectPieces(static_cast<uint64_t>(rand() % n) * stream_piece_size);
+}
+
+// PopNextPiece() during the playback: the playhead moves one piece forward.
+static void BM_MovePlayhead(State& state)
+{
+    std::mt19937 rand{0};
+    std::vector<int> changed;
+    PiecePriorities priorities;
+
+    const auto n = static_cast<int>(state.range());
+    PrepareHalfDownloaded(priorities, n, rand);
+    auto playhead = 0;
+    while (state.KeepRunning()) {
+        playhead = (playhead + 1) % n;
+        priorities.MovePlayhead(playhead);
+        changed.clear();
+        priorities.Update(changed);
+        DoNotOptimize(changed);
+    }
+}
+
+// HandleReadPiece(): the piece read is handed to the cache and looked up in the queue, which holds the
+// whole file.
+static void BM_HandleReadPiece(State& state)
+{
+    std::mt19937 rand{0};
+
+    const auto n = static_cast<int>(state.range());
+    const auto buffer = boost::shared_array<char>{new char[stream_piece_size]};
+    StreamerFixture fixture{n};
+    while (state.KeepRunning()) {
+        EngineEvent event{EngineEvent::read_piece, static_cast<int>(rand() % n)};
+        event.data = buffer;
+        event.size = stream_piece_size;
+        fixture.streamer().HandleEvent(event);
+    }
+}
+
+// Seek within the recently read pieces: lookup in the piece cache.
+static void BM_PieceCacheGet(State& state)
+{
+    std::mt19937 rand{0};
+    PieceCache cache;
+
+    const auto n = static_cast<int>(state.range());
+    const auto buffer = boost::shared_array<char>{new char[1]};
+    cache.set_capacity(n);
+    for (auto i = 0; i < n; ++i)
+        cache.Add(i, buffer);
+
+    while (state.KeepRunning())
+        DoNotOptimize(cache.Get(static_cast<int>(rand() % n)));
+}
+
+// HandlePieceFinished(): availability bitmap update.
+static void BM_AvailabilitySet(State& state)
+{
+    FileAvailability availability;
+
+    const auto n = static_cast<int>(state.range());
+    auto piece = 0;
+    availability.Reset(0, n - 1);
+    while (state.KeepRunning()) {
+        if (piece == n) {
+            state.PauseTiming();
+            availability.Reset(0, n - 1);
+            piece = 0;
+            state.ResumeTiming();
+        }
+        DoNotOptimize(availability.Set(piece++));
+    }
+}
+
+// ReadNextPiece() hand-off: the alert thread hands the pieces read over to the streamer, which signals the
+// reader waiting on it.
+static void BM_ReadNextPieceHandoff(State& state)
+{
+    std::atomic_bool stopped{false};
+    std::thread alerts;
+
+    const auto n = static_cast<int>(state.range());
+    StreamerFixture fixture{n};
+    const auto start_alerts = [&] {
+        stopped = false;
+        alerts = std::thread{[&] {
+            while (!stopped) {
+                if (!fixture.Poll())
+                    std::this_thread::yield();
+            }
+        }};
+    };
+    const auto stop_alerts = [&] {
+        stopped = true;
+        alerts.join();
+    };
+
+    start_alerts();
+    while (state.KeepRunning()) {
+        Piece p;
+        bool eof;
+        for (;;) {
+            fixture.streamer().ReadNextPiece(p, eof, whole_piece);
+            if (p.data != nullptr)
+                break;
+            if (eof) {
+                state.PauseTiming();
+                stop_alerts();
+                fixture.Restart();
+                start_alerts();
+                state.ResumeTiming();
+                continue;
+            }
+            fixture.streamer().WaitReady(std::chrono::milliseconds{100});
+        }
+        DoNotOptimize(p);
+    }
+    stop_alerts();
+}
+
+// Checks a piece read from a filled in-memory torrent, expected at the given position of the file.
+static void VerifyPiece(const Piece& p, uint64_t position)
+{
+    const auto offset = static_cast<uint64_t>(p.id) * stream_piece_size + p.offset;
+    if (offset != position)
+        throw std::runtime_error{"read offset " + std::to_string(offset) + " instead of " + std::to_string(position)};
+    for (auto i = 0; i < p.length; ++i) {
+        if (p.data[p.offset + i] != bench::MemoryEngine::Byte(offset + i))
+            throw std::runtime_error{"corrupted data at offset " + std::to_string(offset + i)};
+    }
+}
+
+// ReadNextPiece() end to end: PieceStreamer reading a file downloaded by the in-memory engine.
+static void BM_StreamPieces(State& state)
+{
+    auto position = uint64_t{0};
+
+    const auto n = static_cast<int>(state.range());
+    StreamerFixture fixture{n, verify_stream};
+    while (state.KeepRunning()) {
+        Piece p;
+        bool eof;
+        for (;;) {
+            fixture.streamer().ReadNextPiece(p, eof, whole_piece);
+            if (p.data != nullptr)
+                break;
+            if (eof) {
+                state.PauseTiming();
+                fixture.Restart();
+                position = 0;
+                state.ResumeTiming();
+                continue;
+            }
+            fixture.Poll();
+        }
+        if (verify_stream)
+            VerifyPiece(p, position);
+        position += p.length;
+        DoNotOptimize(p);
+    }
+}
+
+static const struct {
+    const char*                name;
+    void                       (*run)(State&);
+    std::initializer_list<int> ranges;
+} benchmarks[] = {
+    {"PrioritiesReset", BM_PrioritiesReset, piece_counts},
+    {"SelectPieces", BM_SelectPieces, piece_counts},
+    {"MovePlayhead", BM_MovePlayhead, piece_counts},
+    {"HandleReadPiece", BM_HandleReadPiece, queue_lengths},
+    {"PieceCacheGet", BM_PieceCacheGet, {16, 64, 256}},
+    {"AvailabilitySet", BM_AvailabilitySet, piece_counts},
+    {"ReadNextPieceHandoff", BM_ReadNextPieceHandoff, {1 << 14}},
+    {"StreamPieces", BM_StreamPieces, {1 << 10, 1 << 14, 1 << 17}},
+};
+
+int main(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        {"filter", required_argument, nullptr, 'f'},
+        {"min-time", required_argument, nullptr, 't'},
+        {"verify", no_argument, nullptr, 'V'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    std::string filter;
+    auto min_time = std::chrono::duration<double>{0.5};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'f': filter = optarg; break;
+            case 't': min_time = std::chrono::duration<double>{atof(optarg)}; break;
+            case 'V': verify_stream = true; break;
+            default:
+                fprintf(stderr, "usage: %s [--filter=SUBSTRING] [--min-time=S] [--verify]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("%-32s %14s %12s\n", "Benchmark", "Time (ns)", "Iterations");
+    try {
+        for (const auto& b : benchmarks) {
+            for (const auto range : b.ranges) {
+                const auto name = std::string{b.name} + "/" + std::to_string(range);
+                if (name.find(filter) == std::string::npos)
+                    continue;
+
+                // Grow the number of iterations until the run lasts long enough to be meaningful.
+                for (uint64_t iterations = 1;; ) {
+                    State state{range, iterations};
+                    b.run(state);
+
+                    const auto elapsed = std::chrono::duration<double>{state.elapsed()};
+                    if (elapsed >= min_time || iterations >= 1000000000) {
+                        printf("%-32s %14.1f %12" PRIu64 "\n", name.c_str(), elapsed.count() * 1e9 / iterations,
+                               iterations);
+                        break;
+                    }
+                    const auto scale = elapsed.count() > 0 ? min_time.count() * 1.4 / elapsed.count() : 10.;
+                    iterations = std::max(iterations + 1, static_cast<uint64_t>(iterations * std::min(scale, 10.)));
+                }
+            }
+        }
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Trace replay benchmark: the seeks and reads of a demuxer, recorded by the access with the
+// torrent-trace-file option, are replayed against a synthetic torrent of the same size seeded
+// on localhost, and the latency of every call is compared to the recorded one.
+//
+// Usage: torrent-bench-replay --trace=PATH [options]
+//   --trace=PATH          trace recorded with --torrent-trace-file
+//   --piece-size=KiB      piece size of the synthetic torrent (1024)
+//   --block-size=KiB      torrent-block-size option (0)
+//   --upload-rate=KBPS    upload rate limit of the seeder in kB/s (0=unlimited)
+//   --realtime            issue the calls at their recorded time instead of back to back
+//   --calls               print the latency of every call
+//   --verbose             libvlc debug output
+
+#include <cstdio>
+#include <cinttypes>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <getopt.h>
+
+#include "harness.h"
+
+using namespace bench;
+
+struct Call
+{
+    enum { seek, read } type;
+    int                 line;
+    uint64_t            time;       // us since the beginning of the playback
+    uint64_t            offset;
+    uint64_t            requested;
+    int64_t             returned;
+    uint64_t            duration;   // us, as recorded
+    uint64_t            replayed;   // us
+    bool                after_seek; // First read following a seek.
+};
+
+static bool LoadTrace(const std::string& path, uint64_t& file_size, std::vector<Call>& calls)
+{
+    std::ifstream file{path};
+    std::string line;
+
+    if (!std::getline(file, line) || sscanf(line.c_str(), "# torrent trace %" SCNu64, &file_size) != 1)
+        return false;
+
+    auto after_seek = false;
+    for (auto n = 2; std::getline(file, line); ++n) {
+        std::istringstream in{line};
+        std::string type;
+        Call call{Call::seek, n, 0, 0, 0, 0, 0, 0, false};
+
+        in >> call.time >> type >> call.offset;
+        if (type == "seek") {
+            in >> call.duration;
+            after_seek = true;
+        }
+        else if (type == "read") {
+            call.type = Call::read;
+            in >> call.requested >> call.returned >> call.duration;
+            if (call.returned <= 0)
+                continue; // Nothing was read, the following call retries.
+            call.after_seek = after_seek;
+            after_seek = false;
+        }
+        else
+            return false;
+        if (!in)
+            return false;
+        calls.push_back(call);
+    }
+    return !calls.empty();
+}
+
+static void Report(const std::vector<Call>& calls, const char* name, bool (*filter)(const Call&))
+{
+    Histogram recorded;
+    Histogram replayed;
+
+    for (const auto& c : calls) {
+        if (filter(c)) {
+            recorded.Add(std::chrono::microseconds{c.duration});
+            replayed.Add(std::chrono::microseconds{c.replayed});
+        }
+    }
+    if (recorded.count() == 0)
+        return;
+
+    std::ostringstream os;
+    recorded.Dump(os, (std::string{"recorded "} + name).c_str(), false);
+    replayed.Dump(os, (std::string{"replayed "} + name).c_str(), false);
+    fputs(os.str().c_str(), stdout);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        {"trace", required_argument, nullptr, 't'},
+        {"piece-size", required_argument, nullptr, 'p'},
+        {"block-size", required_argument, nullptr, 'b'},
+        {"upload-rate", required_argument, nullptr, 'u'},
+        {"realtime", no_argument, nullptr, 'R'},
+        {"calls", no_argument, nullptr, 'c'},
+        {"verbose", no_argument, nullptr, 'v'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    std::string trace;
+    int piece_size = 1024;
+    int upload_rate = 0;
+    bool realtime = false;
+    bool print_calls = false;
+    bool verbose = false;
+    uint64_t file_size;
+    Options options;
+    std::vector<Call> calls;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 't': trace = optarg; break;
+            case 'p': piece_size = atoi(optarg); break;
+            case 'b': options.block_size = atoi(optarg); break;
+            case 'u': upload_rate = atoi(optarg); break;
+            case 'R': realtime = true; break;
+            case 'c': print_calls = true; break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s --trace=PATH [--piece-size=KiB] [--block-size=KiB] [--upload-rate=KBPS] "
+                                "[--realtime] [--calls] [--verbose]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (trace.empty() || piece_size < 16 || (piece_size & (piece_size - 1)) || upload_rate < 0) {
+        fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+        return 1;
+    }
+    if (!LoadTrace(trace, file_size, calls) || file_size == 0) {
+        fprintf(stderr, "%s: invalid trace %s\n", argv[0], trace.c_str());
+        return 1;
+    }
+
+    try {
+        TempDir tmp;
+
+        printf("creating a %" PRIu64 " bytes torrent with %d KiB pieces\n", file_size, piece_size);
+        const auto torrent = CreateTorrent(tmp.Sub("seed"), file_size, piece_size * 1024);
+        Seeder seeder{torrent, upload_rate};
+        Vlc vlc{tmp.Sub("cache"), verbose};
+
+        Streamer streamer{vlc, torrent, tmp.Sub("download"), options};
+        if (streamer.Start() != VLC_SUCCESS) {
+            fprintf(stderr, "%s: could not start the download\n", argv[0]);
+            return 1;
+        }
+        streamer.AddPeer("127.0.0.1", seeder.port());
+
+        const auto start = clock::now();
+        for (auto& call : calls) {
+            if (realtime)
+                std::this_thread::sleep_until(start + std::chrono::microseconds{call.time});
+
+            const auto call_start = clock::now();
+            if (call.type == Call::seek)
+                streamer.Seek(call.offset);
+            else {
+                if (streamer.position() != call.offset)
+                    streamer.Seek(call.offset); // Stay in line with the recording, e.g. after a short read.
+                streamer.Read(call.returned);
+            }
+            call.replayed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - call_start).count();
+
+            if (print_calls)
+                printf("  %5d %s %12" PRIu64 " %10" PRId64 "%s: %10" PRIu64 "us (recorded %" PRIu64 "us)\n",
+                       call.line, call.type == Call::seek ? "seek" : "read", call.offset,
+                       call.type == Call::seek ? 0 : call.returned, call.after_seek ? " after seek" : "",
+                       call.replayed, call.duration);
+        }
+        printf("replayed %zu calls of %s in %.3f s\n", calls.size(), trace.c_str(),
+               seconds{clock::now() - start}.count());
+
+        Report(calls, "seek", [](const Call& c) { return c.type == Call::seek; });
+        Report(calls, "read", [](const Call& c) { return c.type == Call::read && !c.after_seek; });
+        Report(calls, "read after seek", [](const Call& c) { return c.after_seek; });
+
+        std::sort(std::begin(calls), std::end(calls), [](const Call& a, const Call& b) {
+            return a.replayed > b.replayed;
+        });
+        printf("slowest calls:\n");
+        for (size_t i = 0; i < std::min<size_t>(calls.size(), 5); ++i) {
+            const auto& call = calls[i];
+            printf("  line %d: %s at %" PRIu64 "%s: %" PRIu64 "us (recorded %" PRIu64 "us)\n", call.line,
+                   call.type == Call::seek ? "seek" : "read", call.offset, call.after_seek ? " after seek" : "",
+                   call.replayed, call.duration);
+        }
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Offline streaming benchmark: a synthetic torrent is seeded from a second session on localhost
+// and read through TorrentAccess following a script of play and seek steps.
+//
+// Usage: torrent-bench-streaming [options]
+//   --size=MiB            size of the synthetic file (256)
+//   --piece-size=KiB      piece size of the synthetic torrent (1024)
+//   --block-size=KiB      torrent-block-size option (0)
+//   --profile=NAME        torrent-profile option (desktop)
+//   --script=STEPS        comma separated play:SIZE and seek:OFFSET steps, OFFSET may be a percentage
+//   --runs=N              number of downloads from scratch (1)
+//   --verify              compare every byte read against the seeded file
+//   --stats-file=PATH     torrent-stats-file option
+//   --verbose             libvlc debug output
+
+#include <cstdio>
+#include <cinttypes>
+#include <stdexcept>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <getopt.h>
+
+#include "harness.h"
+
+using namespace bench;
+
+static const auto default_script = "play:32M,seek:50%,play:16M,seek:90%,play:8M,seek:10%,play:8M";
+
+struct Result
+{
+    double ttfb = 0;         // s
+    double throughput = 0;   // MiB/s, once the first byte of each play step is read
+    double seek_latency = 0; // s, averaged over the seeks
+    double cpu_per_mib = 0;  // ms, the seeding session included
+    int    stalls = 0;
+};
+
+static int Run(Vlc& vlc, const SyntheticTorrent& torrent, const Seeder& seeder, const std::string& download_dir,
+               const Options& options, bool verify, const std::vector<Step>& steps, Result& result)
+{
+    const auto mib = 1024. * 1024.;
+
+    Streamer streamer{vlc, torrent, download_dir, options};
+    streamer.set_verify(verify);
+
+    const auto cpu_start = CpuTime();
+    const auto start = clock::now();
+    if (streamer.Start() != VLC_SUCCESS)
+        return VLC_EGENERIC;
+    streamer.AddPeer("127.0.0.1", seeder.port());
+
+    auto seek_start = start;
+    auto pending_seek = false;
+    auto first = true;
+    auto seeks = 0;
+    uint64_t bytes = 0;
+    seconds streaming{0};
+
+    for (const auto& step : steps) {
+        if (step.type == Step::seek) {
+            const auto offset = step.percent ? streamer.size() * step.value / 100 : step.value;
+            seek_start = clock::now();
+            pending_seek = true;
+            streamer.Seek(offset);
+            continue;
+        }
+
+        const auto play_start = clock::now();
+        const auto stats = streamer.Read(step.value);
+        const auto rate = stats.bytes / mib / std::max(1e-9, (stats.elapsed - stats.first_byte).count());
+        printf("  %-12s %8.1f MiB in %7.3f s, %8.1f MiB/s, first byte %7.3f s, %d stalls\n",
+               step.text.c_str(), stats.bytes / mib, stats.elapsed.count(), rate, stats.first_byte.count(),
+               stats.stalls);
+
+        if (stats.bytes == 0)
+            continue;
+        if (first)
+            result.ttfb = seconds{play_start - start + stats.first_byte}.count();
+        else if (pending_seek) {
+            result.seek_latency += seconds{play_start - seek_start + stats.first_byte}.count();
+            ++seeks;
+        }
+        first = false;
+        pending_seek = false;
+        bytes += stats.bytes;
+        streaming += stats.elapsed - stats.first_byte;
+        result.stalls += stats.stalls;
+    }
+
+    if (seeks > 0)
+        result.seek_latency /= seeks;
+    result.throughput = bytes / mib / std::max(1e-9, streaming.count());
+    result.cpu_per_mib = bytes > 0 ? (CpuTime() - cpu_start).count() * 1000 / (bytes / mib) : 0;
+    return VLC_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        {"size", required_argument, nullptr, 's'},
+        {"piece-size", required_argument, nullptr, 'p'},
+        {"block-size", required_argument, nullptr, 'b'},
+        {"profile", required_argument, nullptr, 'P'},
+        {"script", required_argument, nullptr, 'c'},
+        {"runs", required_argument, nullptr, 'r'},
+        {"verify", no_argument, nullptr, 'V'},
+        {"stats-file", required_argument, nullptr, 'f'},
+        {"verbose", no_argument, nullptr, 'v'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    uint64_t size = 256;
+    int piece_size = 1024;
+    int runs = 1;
+    bool verify = false;
+    bool verbose = false;
+    std::string script = default_script;
+    Options options;
+    std::vector<Step> steps;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 's': size = strtoull(optarg, nullptr, 10); break;
+            case 'p': piece_size = atoi(optarg); break;
+            case 'b': options.block_size = atoi(optarg); break;
+            case 'P': options.profile = optarg; break;
+            case 'c': script = optarg; break;
+            case 'r': runs = atoi(optarg); break;
+            case 'V': verify = true; break;
+            case 'f': options.stats_file = optarg; break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [--size=MiB] [--piece-size=KiB] [--block-size=KiB] [--profile=NAME] "
+                                "[--script=STEPS] [--runs=N] [--verify] [--stats-file=PATH] [--verbose]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (size == 0 || piece_size < 16 || (piece_size & (piece_size - 1)) || runs < 1 ||
+        !ParseScript(script, steps)) {
+        fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+        return 1;
+    }
+
+    try {
+        TempDir tmp;
+
+        printf("creating a %" PRIu64 " MiB torrent with %d KiB pieces\n", size, piece_size);
+        const auto torrent = CreateTorrent(tmp.Sub("seed"), size * 1024 * 1024, piece_size * 1024);
+        Seeder seeder{torrent};
+        Vlc vlc{tmp.Sub("cache"), verbose};
+
+        Result total;
+        for (auto i = 0; i < runs; ++i) {
+            Result result;
+
+            printf("run %d: %s\n", i + 1, script.c_str());
+            if (Run(vlc, torrent, seeder, tmp.Sub("download-" + std::to_string(i)), options, verify, steps,
+                    result) != VLC_SUCCESS) {
+                fprintf(stderr, "%s: could not start the download\n", argv[0]);
+                return 1;
+            }
+            printf("  ttfb %.3f s, throughput %.1f MiB/s, seek latency %.3f s, cpu %.2f ms/MiB, %d stalls\n",
+                   result.ttfb, result.throughput, result.seek_latency, result.cpu_per_mib, result.stalls);
+
+            total.ttfb += result.ttfb / runs;
+            total.throughput += result.throughput / runs;
+            total.seek_latency += result.seek_latency / runs;
+            total.cpu_per_mib += result.cpu_per_mib / runs;
+            total.stalls += result.stalls;
+        }
+        printf("mean over %d runs: ttfb %.3f s, throughput %.1f MiB/s, seek latency %.3f s, cpu %.2f ms/MiB, "
+               "%d stalls\n", runs, total.ttfb, total.throughput, total.seek_latency, total.cpu_per_mib,
+               total.stalls);
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*****************************************************************************
+ * Copyright (C) 2014 VLC authors, VideoLAN and Videolabs
+ *
+ * Authors: Jonathan Calmels <exxo@videolabs.io>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Simulated swarm benchmark: a synthetic torrent is seeded by several local sessions, each one behind
+// a relay adding latency, throttled to its own upload rate and possibly leaving the swarm in the middle
+// of a piece. The file is played at a constant bitrate, the way a player consumes it, to measure the
+// stalls and the rebuffering of the streaming path.
+//
+// Usage: torrent-bench-swarm [options]
+//   --size=MiB            size of the synthetic file (128)
+//   --piece-size=KiB      piece size of the synthetic torrent (1024)
+//   --block-size=KiB      torrent-block-size option (0)
+//   --seeders=N           number of seeding sessions (4)
+//   --upload-rate=LIST    comma separated upload rate limits in kB/s, cycled over the seeders (500,1000)
+//   --latency=LIST        comma separated round trip times in ms, cycled over the seeders (50,200)
+//   --churn=S             mean time between two seeder disconnections, 0 for none (10)
+//   --downtime=S          time a disconnected seeder stays unreachable (5)
+//   --bitrate=KBPS        playback bitrate in kbit/s (4000)
+//   --buffer=S            data buffered before the playback starts and read ahead afterwards (1)
+//   --script=STEPS        comma separated play:SIZE and seek:OFFSET steps, OFFSET may be a percentage
+//   --runs=N              number of downloads from scratch (1)
+//   --seed=N              seed of the churn, for reproducible runs (0)
+//   --verbose             libvlc debug output
+
+#include <cstdio>
+#include <cinttypes>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <getopt.h>
+
+#include "harness.h"
+
+using namespace bench;
+
+static const auto default_script = "play:16M,seek:50%,play:8M,seek:20%,play:8M";
+
+struct Result
+{
+    int     stalls = 0;
+    int     rebuffers = 0;
+    seconds rebuffer_time{0};
+    seconds startup{0};      // Summed over the play steps.
+    seconds played{0};       // Media duration played.
+    int     disconnections = 0;
+};
+
+static bool ParseList(const std::string& list, std::vector<int>& values)
+{
+    std::istringstream in{list};
+    std::string value;
+
+    values.clear();
+    while (std::getline(in, value, ',')) {
+        char* end;
+        values.push_back(strtol(value.c_str(), &end, 10));
+        if (end == value.c_str() || *end != '\0' || values.back() < 0)
+            return false;
+    }
+    return !values.empty();
+}
+
+static int Run(Vlc& vlc, const SyntheticTorrent& torrent, Swarm& swarm, const std::string& download_dir,
+               const Options& options, uint64_t bitrate, seconds buffer, const std::vector<Step>& steps,
+               Result& result)
+{
+    const auto mib = 1024. * 1024.;
+
+    Streamer streamer{vlc, torrent, download_dir, options};
+    if (streamer.Start() != VLC_SUCCESS)
+        return VLC_EGENERIC;
+
+    const auto disconnections = swarm.disconnections();
+    swarm.Join(streamer);
+    for (const auto& step : steps) {
+        if (step.type == Step::seek) {
+            streamer.Seek(step.percent ? streamer.size() * step.value / 100 : step.value);
+            continue;
+        }
+
+        const auto stats = streamer.Play(step.value, bitrate, buffer);
+        printf("  %-12s %8.1f MiB in %7.3f s, startup %6.3f s, %d rebuffers (%.3f s), %d stalls\n",
+               step.text.c_str(), stats.bytes / mib, stats.elapsed.count(), stats.startup.count(),
+               stats.rebuffers, stats.rebuffer_time.count(), stats.stalls);
+
+        result.stalls += stats.stalls;
+        result.rebuffers += stats.rebuffers;
+        result.rebuffer_time += stats.rebuffer_time;
+        result.startup += stats.startup;
+        result.played += seconds{double(stats.bytes) / bitrate};
+    }
+    swarm.Leave();
+    result.disconnections = swarm.disconnections() - disconnections;
+    return VLC_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        {"size", required_argument, nullptr, 's'},
+        {"piece-size", required_argument, nullptr, 'p'},
+        {"block-size", required_argument, nullptr, 'b'},
+        {"seeders", required_argument, nullptr, 'n'},
+        {"upload-rate", required_argument, nullptr, 'u'},
+        {"latency", required_argument, nullptr, 'l'},
+        {"churn", required_argument, nullptr, 'c'},
+        {"downtime", required_argument, nullptr, 'd'},
+        {"bitrate", required_argument, nullptr, 'B'},
+        {"buffer", required_argument, nullptr, 'f'},
+        {"script", required_argument, nullptr, 'S'},
+        {"runs", required_argument, nullptr, 'r'},
+        {"seed", required_argument, nullptr, 'e'},
+        {"verbose", no_argument, nullptr, 'v'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    uint64_t size = 128;
+    int piece_size = 1024;
+    int runs = 1;
+    uint64_t bitrate = 4000;
+    double buffer = 1;
+    bool verbose = false;
+    bool valid = true;
+    std::string script = default_script;
+    Options options;
+    SwarmOptions swarm_options;
+    std::vector<Step> steps;
+
+    swarm_options.upload_rates = {500, 1000};
+    swarm_options.latencies = {50, 200};
+    swarm_options.churn = seconds{10};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 's': size = strtoull(optarg, nullptr, 10); break;
+            case 'p': piece_size = atoi(optarg); break;
+            case 'b': options.block_size = atoi(optarg); break;
+            case 'n': swarm_options.seeders = atoi(optarg); break;
+            case 'u': valid &= ParseList(optarg, swarm_options.upload_rates); break;
+            case 'l': valid &= ParseList(optarg, swarm_options.latencies); break;
+            case 'c': swarm_options.churn = seconds{atof(optarg)}; break;
+            case 'd': swarm_options.downtime = seconds{atof(optarg)}; break;
+            case 'B': bitrate = strtoull(optarg, nullptr, 10); break;
+            case 'f': buffer = atof(optarg); break;
+            case 'S': script = optarg; break;
+            case 'r': runs = atoi(optarg); break;
+            case 'e': swarm_options.seed = strtoul(optarg, nullptr, 10); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [--size=MiB] [--piece-size=KiB] [--block-size=KiB] [--seeders=N] "
+                                "[--upload-rate=LIST] [--latency=LIST] [--churn=S] [--downtime=S] "
+                                "[--bitrate=KBPS] [--buffer=S] [--script=STEPS] [--runs=N] [--seed=N] "
+                                "[--verbose]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (!valid || size == 0 || piece_size < 16 || (piece_size & (piece_size - 1)) || runs < 1 ||
+        swarm_options.seeders < 1 || swarm_options.seeders > 254 || bitrate == 0 || buffer < 0 ||
+        !ParseScript(script, steps)) {
+        fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+        return 1;
+    }
+    bitrate = bitrate * 1000 / 8;
+
+    try {
+        TempDir tmp;
+
+        printf("creating a %" PRIu64 " MiB torrent with %d KiB pieces, seeded by %d sessions\n", size, piece_size,
+               swarm_options.seeders);
+        const auto torrent = CreateTorrent(tmp.Sub("seed"), size * 1024 * 1024, piece_size * 1024);
+        Swarm swarm{torrent, swarm_options};
+        Vlc vlc{tmp.Sub("cache"), verbose};
+
+        Result total;
+        for (auto i = 0; i < runs; ++i) {
+            Result result;
+
+            printf("run %d: %s\n", i + 1, script.c_str());
+            if (Run(vlc, torrent, swarm, tmp.Sub("download-" + std::to_string(i)), options, bitrate,
+                    seconds{buffer}, steps, result) != VLC_SUCCESS) {
+                fprintf(stderr, "%s: could not start the download\n", argv[0]);
+                return 1;
+            }
+            printf("  %d stalls, %d rebuffers, rebuffer time %.3f s (%.1f%% of %.1f s played), startup %.3f s, "
+                   "%d disconnections\n", result.stalls, result.rebuffers, result.rebuffer_time.count(),
+                   100 * result.rebuffer_time.count() / std::max(1e-9, result.played.count()),
+                   result.played.count(), result.startup.count(), result.disconnections);
+
+            total.stalls += result.stalls;
+            total.rebuffers += result.rebuffers;
+            total.rebuffer_time += result.rebuffer_time;
+            total.startup += result.startup;
+            total.played += result.played;
+            total.disconnections += result.disconnections;
+        }
+        printf("total over %d runs: %d stalls, %d rebuffers, rebuffer time %.3f s (%.1f%%), startup %.3f s, "
+               "%d disconnections\n", runs, total.stalls, total.rebuffers, total.rebuffer_time.count(),
+               100 * total.rebuffer_time.count() / std::max(1e-9, total.played.count()), total.startup.count(),
+               total.disconnections);
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
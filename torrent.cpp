@@ -21,8 +21,10 @@
 #include <cassert>
 #include <functional>
 #include <fstream>
+#include <sstream>
+#include <cinttypes>
 #include <chrono>
-#include <unordered_map>
+#include <algorithm>
 
 #ifdef HAVE_CONFIG_H
 # include "config.h"
@@ -30,38 +32,1180 @@
 
 #include <vlc_common.h>
 #include <vlc_url.h>
+#include <vlc_fs.h>
 
 #undef poll // XXX boost redefines poll inside libtorrent headers
 
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/create_torrent.hpp>
-#include <libtorrent/extensions/metadata_transfer.hpp>
-#include <libtorrent/extensions/ut_metadata.hpp>
-#include <libtorrent/extensions/ut_pex.hpp>
-#include <libtorrent/extensions/smart_ban.hpp>
 #include <libtorrent/magnet_uri.hpp>
 #include <libtorrent/bencode.hpp>
+#if LIBTORRENT_VERSION_NUM >= 10100
+# include <libtorrent/bdecode.hpp>
+# include <libtorrent/fingerprint.hpp>
+# include <libtorrent/session_stats.hpp>
+#else
+# include <libtorrent/extensions/metadata_transfer.hpp>
+# include <libtorrent/extensions/ut_metadata.hpp>
+# include <libtorrent/extensions/ut_pex.hpp>
+# include <libtorrent/extensions/smart_ban.hpp>
+#endif
+#if LIBTORRENT_VERSION_NUM >= 10200
+# include <libtorrent/read_resume_data.hpp>
+# include <libtorrent/write_resume_data.hpp>
+#endif
+#if LIBTORRENT_VERSION_NUM >= 20000
+# include <libtorrent/session_params.hpp>
+#endif
+
+#include "torrent.h"
+
+static const auto playhead_window = 8 * 1024 * 1024; // Bytes ahead of the playhead downloaded first.
+static const auto prefetch_window = 2 * 1024 * 1024; // Bytes prefetched at the file boundaries and seek targets.
+static const auto max_window_factor = 10;            // Maximum playhead window scaling for slow swarms.
+static const auto max_saved_peers = 32;              // Peers remembered per torrent for the next sessions.
+static const auto dht_bootstrap_timeout = std::chrono::seconds{5}; // Wait on the saved DHT nodes before the routers.
+static const auto dht_checkpoint_interval = std::chrono::seconds{60};
+
+// Variables published on the input.
+static const struct {
+    const char* name;
+    int         type;
+} input_vars[] = {
+    {"torrent-availability", VLC_VAR_STRING},     // Pieces of the file available (see FileAvailability).
+    {"torrent-buffered-bytes", VLC_VAR_INTEGER},  // Bytes available ahead of the playhead.
+    {"torrent-buffered-time", VLC_VAR_INTEGER},   // Estimated duration available ahead of the playhead (ms).
+    {"torrent-stalls", VLC_VAR_INTEGER},          // Reads which returned no data.
+    {"torrent-piece-latency", VLC_VAR_INTEGER},   // Average piece request to arrival latency (ms).
+    {"torrent-piece-latency-max", VLC_VAR_INTEGER},
+    {"torrent-download-rate", VLC_VAR_INTEGER},   // Payload download rate (bytes/s).
+    {"torrent-upload-rate", VLC_VAR_INTEGER},     // Payload upload rate (bytes/s).
+    {"torrent-peers", VLC_VAR_INTEGER},
+};
+
+// Session tuning selected with the torrent-profile option, the first one is the default.
+// The disk queue and cache start at their minimum and are tuned at runtime (see DiskTuner).
+static const struct StreamingProfile {
+    const char* name;
+    int         disk_queue[2];         // I/O thread buffer queue bounds in bytes (limits the download rate when full).
+    int         cache_size[2];         // Disk read/write cache bounds in units of 16 KiB, unused since 2.0.
+    int         aio_threads;           // Disk I/O threads.
+    int         request_queue_time;    // Seconds of download queued up per peer.
+    int         max_out_request_queue; // Maximum number of outstanding requests per peer.
+    int         connections_limit;     // Maximum number of connections of the session.
+    int         max_peerlist_size;     // Maximum number of peers per torrent.
+    int         num_want;              // Number of peers requested per tracker.
+} profiles[] = {
+    {"desktop",  {2 << 20,  32 << 20}, { 512,  8192}, 4, 3,  500, 200,  3000, 200},
+    {"embedded", {1 << 19,   2 << 20}, {  64,   256}, 1, 3,  250,  50,   500,  50},
+    {"server",   {8 << 20, 256 << 20}, {4096, 65536}, 8, 5, 1500, 800, 10000, 400},
+};
+
+// DHT routers, only bootstrapped from when none of the nodes saved answers (see MaintainDHT).
+static const struct {
+    const char* host;
+    int         port;
+} dht_routers[] = {
+    {"router.bittorrent.com", 6881},
+    {"router.utorrent.com", 6881},
+    {"router.bitcomet.com", 6881},
+    {"dht.libtorrent.org", 25401},
+};
+
+Histogram::Histogram()
+{
+    for (auto& b : buckets_)
+        b.store(0, std::memory_order_relaxed);
+}
+
+size_t Histogram::BucketOf(uint64_t us)
+{
+    if (us < 4)
+        return us;
+
+#ifdef __GNUC__
+    const auto exp = 63 - __builtin_clzll(us);
+#else
+    auto exp = 0;
+    while (us >> (exp + 1))
+        ++exp;
+#endif
+    const auto sub = (us >> (exp - 2)) & 3;
+    return (exp - 1) * 4 + sub;
+}
+
+uint64_t Histogram::LowerBound(size_t bucket)
+{
+    if (bucket < 4)
+        return bucket;
+
+    const auto exp = bucket / 4 + 1;
+    const auto sub = bucket % 4;
+    return (4 + sub) << (exp - 2);
+}
+
+void Histogram::Add(std::chrono::microseconds d)
+{
+    const auto us = static_cast<uint64_t>(std::max<int64_t>(d.count(), 0));
+    buckets_[BucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::chrono::microseconds Histogram::Percentile(double p) const
+{
+    const auto total = count();
+    if (total == 0)
+        return std::chrono::microseconds{0};
+
+    // Report the upper bound of the bucket where the percentile lies.
+    const auto rank = static_cast<uint64_t>(p / 100 * (total - 1)) + 1;
+    auto n = uint64_t{0};
+    for (size_t i = 0; i < num_buckets - 1; ++i) {
+        n += buckets_[i].load(std::memory_order_relaxed);
+        if (n >= rank)
+            return std::chrono::microseconds(LowerBound(i + 1) - 1);
+    }
+    return std::chrono::microseconds(LowerBound(num_buckets - 1));
+}
+
+void Histogram::Dump(std::ostream& os, const char* name, bool buckets) const
+{
+    os << name << ": count=" << count();
+    for (const auto p : {50., 90., 99., 99.9})
+        os << " p" << p << "=" << Percentile(p).count() << "us";
+    os << "\n";
+
+    if (!buckets)
+        return;
+    for (size_t i = 0; i < num_buckets; ++i) {
+        const auto n = buckets_[i].load(std::memory_order_relaxed);
+        if (n > 0)
+            os << name << "[" << LowerBound(i) << "us]: " << n << "\n";
+    }
+}
+
+void PieceCache::Add(int id, const boost::shared_array<char>& data)
+{
+    if (capacity_ == 0)
+        return;
+
+    const auto p = std::find_if(std::begin(pieces_), std::end(pieces_),
+      [id](const decltype(pieces_)::value_type& p) { return p.first == id; }
+    );
+    if (p != std::end(pieces_))
+        pieces_.erase(p);
+    else if (pieces_.size() == capacity_)
+        pieces_.pop_front();
+    pieces_.emplace_back(id, data);
+}
+
+boost::shared_array<char> PieceCache::Get(int id)
+{
+    const auto p = std::find_if(std::begin(pieces_), std::end(pieces_),
+      [id](const decltype(pieces_)::value_type& p) { return p.first == id; }
+    );
+    if (p == std::end(pieces_))
+        return {};
+
+    // Move it to the back, it's now the most recently used.
+    const auto data = p->second;
+    pieces_.erase(p);
+    pieces_.emplace_back(id, data);
+    return data;
+}
+
+void FileAvailability::Reset(int first, int last)
+{
+    first_ = first;
+    last_ = last;
+    bitmap_.assign((last - first + 4) / 4, '0');
+}
+
+bool FileAvailability::Set(int piece)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if (piece < first_ || piece > last_)
+        return false;
+
+    auto& digit = bitmap_[(piece - first_) / 4];
+    const auto value = std::strchr(hex, digit) - hex;
+    const auto bit = 8 >> (piece - first_) % 4;
+    if (value & bit)
+        return false;
+
+    digit = hex[value | bit];
+    return true;
+}
+
+void ReadyEvent::Signal()
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    signaled_ = true;
+    cond_.notify_all();
+}
+
+void ReadyEvent::Clear()
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    signaled_ = false;
+}
+
+void ReadyEvent::Interrupt()
+{
+    const auto lock = std::unique_lock<std::mutex>{mutex_};
+    interrupted_ = true;
+    cond_.notify_all();
+}
+
+// Returns whether the event got signaled, an interruption only aborts the current wait.
+bool ReadyEvent::Wait(std::chrono::milliseconds timeout)
+{
+    auto lock = std::unique_lock<std::mutex>{mutex_};
+    cond_.wait_for(lock, timeout, [this]{ return signaled_ || interrupted_; });
+
+    const auto signaled = signaled_ && !interrupted_;
+    interrupted_ = false;
+    return signaled;
+}
+
+bool AccessTrace::Open(const char* path, uint64_t file_size)
+{
+    file_.open(path, std::ios_base::trunc);
+    if (!file_)
+        return false;
+    start_ = std::chrono::steady_clock::now();
+    file_ << "# torrent trace " << file_size << "\n";
+    return true;
+}
+
+void AccessTrace::Seek(time_point start, uint64_t offset)
+{
+    using namespace std::chrono;
+
+    const auto now = steady_clock::now();
+    file_ << duration_cast<microseconds>(start - start_).count() << " seek " << offset << " "
+          << duration_cast<microseconds>(now - start).count() << "\n";
+}
+
+void AccessTrace::Read(time_point start, uint64_t offset, uint64_t requested, int64_t returned)
+{
+    using namespace std::chrono;
+
+    const auto now = steady_clock::now();
+    file_ << duration_cast<microseconds>(start - start_).count() << " read " << offset << " " << requested << " "
+          << returned << " " << duration_cast<microseconds>(now - start).count() << "\n";
+}
+
+DiskTuner::DiskTuner(int min_queue, int max_queue, int min_cache, int max_cache) :
+    min_queue_{min_queue},
+    max_queue_{max_queue},
+    min_cache_{min_cache},
+    max_cache_{max_cache},
+    disk_queue_{min_queue},
+    cache_size_{min_cache},
+    idle_{0}
+{}
+
+bool DiskTuner::Update(int download_rate, int64_t queued_bytes)
+{
+    const auto disk_queue = disk_queue_;
+    const auto cache_size = cache_size_;
+
+    // Double the queue as soon as the writes fill it, halve it once they have kept well below it for a while.
+    if (queued_bytes >= disk_queue_ / 4 * 3) {
+        disk_queue_ = std::min(disk_queue_ * 2, max_queue_);
+        idle_ = 0;
+    }
+    else if (queued_bytes < disk_queue_ / 8 && download_rate < disk_queue_ / 4) {
+        if (++idle_ >= shrink_delay) {
+            disk_queue_ = std::max(disk_queue_ / 2, min_queue_);
+            idle_ = 0;
+        }
+    }
+    else
+        idle_ = 0;
+
+    // Keep the last seconds of download in the cache, grow it right away but shrink it by halves.
+    const auto cache_target = static_cast<int>(std::min<int64_t>(int64_t{download_rate} * cache_time / 16384,
+                                                                 max_cache_));
+    if (cache_target > cache_size_)
+        cache_size_ = cache_target;
+    else if (cache_target < cache_size_ / 2)
+        cache_size_ = std::max(cache_size_ / 2, min_cache_);
+
+    return disk_queue_ != disk_queue || cache_size_ != cache_size;
+}
+
+void PiecePriorities::Reset(int num_pieces, int first, int last, int playhead_window, int prefetch_window)
+{
+    first_ = first;
+    last_ = last;
+    playhead_ = first;
+    contiguous_end_ = first;
+    num_have_ = 0;
+    playhead_window_ = playhead_window;
+    prefetch_window_ = prefetch_window;
+    background_ = false;
+    seek_targets_.clear();
+    have_.assign(num_pieces, false);
+    priorities_.assign(num_pieces, -1);
+    dirty_.assign(1, {0, num_pieces});
+}
+
+void PiecePriorities::SetHave(int piece)
+{
+    if (have_[piece])
+        return;
+    have_[piece] = true;
+    Invalidate(piece, 1);
+    if (piece >= first_ && piece <= last_)
+        ++num_have_;
+    if (piece == contiguous_end_)
+        AdvanceContiguousEnd(piece);
+}
+
+void PiecePriorities::AdvanceContiguousEnd(int from)
+{
+    contiguous_end_ = from;
+    while (contiguous_end_ <= last_ && have_[contiguous_end_])
+        ++contiguous_end_;
+}
+
+void PiecePriorities::MovePlayhead(int piece)
+{
+    if (piece == playhead_)
+        return;
+    Invalidate(playhead_, playhead_window_);
+    // Pieces up to the contiguous end are still available when moving forward within them, rescan otherwise.
+    if (piece < playhead_ || piece > contiguous_end_)
+        AdvanceContiguousEnd(piece);
+    playhead_ = piece;
+    Invalidate(playhead_, playhead_window_);
+}
+
+void PiecePriorities::AddSeekTarget(int piece)
+{
+    if (std::find(std::begin(seek_targets_), std::end(seek_targets_), piece) != std::end(seek_targets_))
+        return;
+
+    if (seek_targets_.size() == max_seek_targets) {
+        Invalidate(seek_targets_.front(), prefetch_window_);
+        seek_targets_.pop_front();
+    }
+    seek_targets_.push_back(piece);
+    Invalidate(piece, prefetch_window_);
+}
+
+void PiecePriorities::SetPlayheadWindow(int window)
+{
+    if (window == playhead_window_)
+        return;
+    Invalidate(playhead_, std::max(window, playhead_window_));
+    playhead_window_ = window;
+}
+
+void PiecePriorities::SetBackground(bool enable)
+{
+    if (enable == background_)
+        return;
+    background_ = enable;
+    Invalidate(first_, last_ + 1 - first_);
+}
+
+int PiecePriorities::ContiguousHave() const
+{
+    return contiguous_end_ - playhead_;
+}
+
+bool PiecePriorities::Complete() const
+{
+    return num_have_ == last_ + 1 - first_;
+}
+
+void PiecePriorities::Update(std::vector<int>& changed)
+{
+    for (const auto& range : dirty_) {
+        for (auto i = range.first; i < range.second; ++i) {
+            const auto priority = Compute(i);
+            if (priority == priorities_[i])
+                continue;
+            priorities_[i] = priority;
+            changed.push_back(i);
+        }
+    }
+    dirty_.clear();
+}
+
+int PiecePriorities::Compute(int piece) const
+{
+    const auto in_window = [piece](int first, int len) { return piece >= first && piece < first + len; };
+
+    if (piece < first_ || piece > last_)
+        return have_[piece] ? keep : discard;
+    if (in_window(playhead_, playhead_window_))
+        return playhead;
+    if (in_window(first_, prefetch_window_) || in_window(last_ + 1 - prefetch_window_, prefetch_window_))
+        return prefetch;
+    for (const auto s : seek_targets_) {
+        if (in_window(s, prefetch_window_))
+            return prefetch;
+    }
+    if (have_[piece])
+        return keep;
+    return background_ ? background : discard;
+}
+
+void PiecePriorities::Invalidate(int piece, int len)
+{
+    const auto first = std::max(piece, 0);
+    const auto last = std::min<int>(piece + len, priorities_.size());
+
+    if (first < last)
+        dirty_.emplace_back(first, last);
+}
+
+#if LIBTORRENT_VERSION_NUM >= 10100
+static lt::settings_pack InitialSettings()
+{
+    lt::settings_pack s;
+
+    s.set_str(lt::settings_pack::peer_fingerprint,
+              lt::generate_fingerprint("VL", PACKAGE_VERSION_MAJOR, PACKAGE_VERSION_MINOR,
+                                       PACKAGE_VERSION_REVISION, PACKAGE_VERSION_EXTRA));
+    return s;
+}
+
+LibtorrentEngine::LibtorrentEngine() :
+    session_{InitialSettings()},
+    disk_queued_bytes_{0},
+    dht_nodes_{0},
+    queued_write_bytes_idx_{lt::find_metric_idx("disk.queued_write_bytes")},
+    dht_nodes_idx_{lt::find_metric_idx("dht.dht_nodes")}
+{}
+#else
+LibtorrentEngine::LibtorrentEngine() :
+    fingerprint_{"VL", PACKAGE_VERSION_MAJOR, PACKAGE_VERSION_MINOR,
+                       PACKAGE_VERSION_REVISION, PACKAGE_VERSION_EXTRA},
+    session_{fingerprint_},
+    disk_queued_bytes_{0},
+    dht_nodes_{0}
+{}
+#endif
+
+int LibtorrentEngine::AddTorrent(const lt::add_torrent_params& params)
+{
+    lt::error_code ec;
+
+    handle_ = session_.add_torrent(params, ec);
+    if (ec)
+        return VLC_EGENERIC;
+
+    // Piece priorities and deadlines drive the picker.
+    if (params.ti != nullptr)
+#if LIBTORRENT_VERSION_NUM >= 10200
+        handle_.unset_flags(lt::torrent_flags::sequential_download);
+#else
+        handle_.set_sequential_download(false);
+#endif
+    return VLC_SUCCESS;
+}
+
+void LibtorrentEngine::RemoveTorrent(bool delete_files)
+{
+    if (delete_files)
+        session_.remove_torrent(handle_, lt::session::delete_files);
+    else
+        session_.remove_torrent(handle_);
+}
+
+static std::vector<bool> HavePieces(const lt::torrent_handle& handle)
+{
+    const auto pieces = handle.status(lth::query_pieces).pieces;
+
+    std::vector<bool> have(pieces.size());
+    for (auto i = 0; i < pieces.size(); ++i)
+        have[i] = pieces[piece_index(i)];
+    return have;
+}
+
+bool LibtorrentEngine::PopEvents(std::chrono::milliseconds timeout, std::vector<EngineEvent>& events)
+{
+#if LIBTORRENT_VERSION_NUM >= 10100
+    std::vector<lt::alert*> alerts; // Owned by the session until the next pop.
+#else
+    std::deque<lt::alert*> alerts;
+#endif
+
+    if (!session_.wait_for_alert(lt::milliseconds(timeout.count())))
+        return false;
+
+    session_.pop_alerts(&alerts);
+    for (const auto alert : alerts) {
+        switch (alert->type()) {
+            case lt::piece_finished_alert::alert_type: {
+                const auto a = lt::alert_cast<lt::piece_finished_alert>(alert);
+                events.emplace_back(EngineEvent::piece_finished, static_cast<int>(a->piece_index));
+                break;
+            }
+            case lt::torrent_checked_alert::alert_type: {
+                const auto a = lt::alert_cast<lt::torrent_checked_alert>(alert);
+                events.emplace_back(EngineEvent::torrent_checked);
+                events.back().pieces = HavePieces(a->handle);
+                break;
+            }
+            case lt::state_changed_alert::alert_type: {
+                const auto a = lt::alert_cast<lt::state_changed_alert>(alert);
+                events.emplace_back(EngineEvent::state_changed);
+                events.back().state = a->state;
+                break;
+            }
+            case lt::save_resume_data_alert::alert_type: {
+                const auto a = lt::alert_cast<lt::save_resume_data_alert>(alert);
+                events.emplace_back(EngineEvent::resume_data_saved);
+#if LIBTORRENT_VERSION_NUM >= 10200
+                events.back().resume_data = std::make_shared<lt::entry>(lt::write_resume_data(a->params));
+#else
+                if (a->resume_data != nullptr)
+                    events.back().resume_data = std::make_shared<lt::entry>(*a->resume_data);
+#endif
+                break;
+            }
+            case lt::save_resume_data_failed_alert::alert_type: // Don't leave the close waiting.
+                events.emplace_back(EngineEvent::resume_data_saved);
+                break;
+            case lt::read_piece_alert::alert_type: {
+                const auto a = lt::alert_cast<lt::read_piece_alert>(alert);
+                events.emplace_back(EngineEvent::read_piece, static_cast<int>(a->piece));
+                events.back().data = a->buffer;
+                events.back().size = a->size;
+                break;
+            }
+            case lt::metadata_received_alert::alert_type: // Magnet file only.
+                events.emplace_back(EngineEvent::metadata_received);
+                break;
+#if LIBTORRENT_VERSION_NUM >= 10100
+            case lt::session_stats_alert::alert_type: { // Requested by UpdateSessionStats.
+                const auto a = lt::alert_cast<lt::session_stats_alert>(alert);
+# if LIBTORRENT_VERSION_NUM >= 10200
+                const auto values = a->counters();
+# else
+                const auto& values = a->values;
+# endif
+                if (queued_write_bytes_idx_ >= 0)
+                    disk_queued_bytes_.store(values[queued_write_bytes_idx_], std::memory_order_relaxed);
+                if (dht_nodes_idx_ >= 0)
+                    dht_nodes_.store(static_cast<int>(values[dht_nodes_idx_]), std::memory_order_relaxed);
+                break;
+            }
+#endif
+        }
+    }
+#if LIBTORRENT_VERSION_NUM < 10100
+    // The alerts popped are ours to free before libtorrent 1.1.
+    for (const auto alert : alerts)
+        delete alert;
+#endif
+    return true;
+}
+
+void LibtorrentEngine::PrioritizePieces(const std::vector<int>& priorities)
+{
+#if LIBTORRENT_VERSION_NUM >= 10200
+    std::vector<piece_priority> p;
+    p.reserve(priorities.size());
+    for (const auto priority : priorities)
+        p.emplace_back(priority);
+    handle_.prioritize_pieces(p);
+#else
+    handle_.prioritize_pieces(priorities);
+#endif
+}
+
+void LibtorrentEngine::SetPiecePriority(int piece, int priority)
+{
+    handle_.piece_priority(piece_index(piece), piece_priority(priority));
+}
+
+void LibtorrentEngine::SetPieceDeadline(int piece)
+{
+    handle_.set_piece_deadline(piece_index(piece), 0, lth::alert_when_available);
+}
+
+void LibtorrentEngine::ClearPieceDeadlines()
+{
+    handle_.clear_piece_deadlines();
+}
+
+void LibtorrentEngine::ReadPiece(int piece)
+{
+    handle_.read_piece(piece_index(piece));
+}
+
+void LibtorrentEngine::SetDownloadLimit(int rate)
+{
+    handle_.set_download_limit(rate);
+}
+
+void LibtorrentEngine::ConnectPeer(const lt::tcp::endpoint& endpoint)
+{
+    handle_.connect_peer(endpoint);
+}
+
+bool LibtorrentEngine::has_torrent() const
+{
+    return handle_.is_valid();
+}
+
+void LibtorrentEngine::UpdateSessionStats()
+{
+#if LIBTORRENT_VERSION_NUM >= 10100
+    session_.post_session_stats(); // Answered with a session_stats_alert.
+#else
+    disk_queued_bytes_.store(session_.get_cache_status().queued_bytes, std::memory_order_relaxed);
+    dht_nodes_.store(session_.status().dht_nodes, std::memory_order_relaxed);
+#endif
+}
+
+std::vector<lt::tcp::endpoint> LibtorrentEngine::BestPeers(size_t max) const
+{
+    std::vector<lt::peer_info> peers;
+    std::vector<lt::tcp::endpoint> endpoints;
+
+    handle_.get_peer_info(peers);
+
+    // Only the peers we connected to are reachable at their address, rank them by bytes delivered per
+    // millisecond of round trip time.
+    const auto score = [](const lt::peer_info& p) { return p.total_download / (p.rtt + 50); };
+    peers.erase(std::remove_if(std::begin(peers), std::end(peers), [](const lt::peer_info& p) {
+        return !(p.flags & lt::peer_info::local_connection) || p.total_download == 0;
+    }), std::end(peers));
+    std::sort(std::begin(peers), std::end(peers), [&score](const lt::peer_info& a, const lt::peer_info& b) {
+        return score(a) > score(b);
+    });
+
+    for (size_t i = 0; i < std::min(peers.size(), max); ++i)
+        endpoints.push_back(peers[i].ip);
+    return endpoints;
+}
+
+std::vector<bool> LibtorrentEngine::have_pieces() const
+{
+    return HavePieces(handle_);
+}
+
+EngineStatus LibtorrentEngine::status() const
+{
+    // The handle is invalidated as soon as the torrent is removed.
+    try {
+        if (handle_.is_valid()) {
+            const auto s = handle_.status();
+            return {s.state, s.download_payload_rate, s.upload_payload_rate, s.num_peers};
+        }
+    }
+    catch (std::exception&) {}
+    return {lts::state_t{}, 0, 0, 0};
+}
+
+int PieceStreamer::Start(const FileLayout& layout)
+{
+    layout_ = layout;
+
+    // Pieces larger than the cache still get the last one kept, only a zero size disables it.
+    const auto cache_size = var_InheritInteger(obj_, "piece-cache-size") * 1024 * 1024;
+    if (cache_size <= 0)
+        msg_Dbg(obj_, "Piece cache disabled");
+    else {
+        if (cache_size < layout_.piece_size)
+            msg_Warn(obj_, "Pieces of %d KiB exceed the piece cache size, keeping one", layout_.piece_size / 1024);
+        cache_.set_capacity(std::max<int64_t>(cache_size / layout_.piece_size, 1));
+    }
+
+    SelectPieces(0);
+    status_.state = engine_.status().state;
+
+    // Publish the pieces of the file available so far.
+    availability_.Reset(layout_.piece(0), layout_.piece(layout_.size - 1));
+    availability_changed_ = true;
+    SetHavePieces(engine_.have_pieces());
+    return VLC_SUCCESS;
+}
+
+void PieceStreamer::HandleEvent(const EngineEvent& event)
+{
+    switch (event.type) {
+        case EngineEvent::state_changed:
+            HandleStateChanged(event.state);
+            break;
+        case EngineEvent::piece_finished:
+            HandlePieceFinished(event.piece);
+            break;
+        case EngineEvent::torrent_checked:
+            // Pieces restored from the resume data or found on disk don't raise piece_finished events.
+            SetHavePieces(event.pieces);
+            break;
+        case EngineEvent::read_piece:
+            HandleReadPiece(event);
+            break;
+        default:
+            break;
+    }
+}
+
+void PieceStreamer::SelectPieces(uint64_t offset)
+{
+    assert(layout_.piece_size > 0);
+
+    offset = std::min(offset, file_size());
+
+    const auto piece_size = layout_.piece_size;
+    const auto beg_piece = layout_.piece(offset);
+    const auto end_piece = layout_.piece(file_size() - 1);
+
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+    queue_.pieces.clear();
+
+    if (priorities_.empty()) {
+        const auto pieces = engine_.have_pieces();
+
+        priorities_.Reset(layout_.num_pieces, layout_.piece(0), end_piece,
+                          std::max(playhead_window / piece_size, 1), std::max(prefetch_window / piece_size, 1));
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (pieces[i])
+                priorities_.SetHave(i);
+        }
+        priorities_.SetBackground(background_threshold_.count() == 0);
+    }
+    consumed_since_ = std::chrono::steady_clock::now();
+    consumed_bytes_ = 0;
+
+    if (offset == file_size())
+        return;
+
+    for (auto i = beg_piece; i <= end_piece; ++i) {
+        auto off = 0;
+        auto len = piece_size;
+        if (i == beg_piece) { // First piece.
+            off = layout_.piece_offset(offset);
+            len = piece_size - off;
+        }
+        if (i == end_piece) // Last piece.
+            len = layout_.piece_offset(file_size() - 1) + 1 - off;
+
+        queue_.pieces.emplace_back(i, off, len);
+    }
+
+    // Serve the first piece from memory if it was read recently.
+    auto& first_piece = queue_.pieces.front();
+    first_piece.data = cache_.Get(first_piece.id);
+    first_piece.requested = first_piece.data != nullptr;
+
+    priorities_.AddSeekTarget(beg_piece);
+    priorities_.MovePlayhead(beg_piece);
+    ApplyPiecePriorities();
+}
+
+void PieceStreamer::SetPaused(bool paused)
+{
+    if (layout_.piece_size == 0) // Not streaming yet.
+        return;
+
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+
+    // While paused, buffer a larger window ahead of the playhead and let the engine pick the pieces freely.
+    // Deadlines are set again when the playback resumes.
+    paused_ = paused;
+    if (paused) {
+        engine_.ClearPieceDeadlines();
+        for (auto& p : queue_.pieces) {
+            if (p.data == nullptr)
+                p.requested = false;
+        }
+    }
+    ApplyPlayheadWindow();
+    ApplyPiecePriorities();
+
+    if (pause_download_rate_ > 0)
+        engine_.SetDownloadLimit(paused ? pause_download_rate_ : -1);
+    msg_Dbg(obj_, "Playback %s", paused ? "paused, buffering ahead" : "resumed");
+}
+
+int64_t PieceStreamer::PtsDelay()
+{
+    const auto network_caching = var_InheritInteger(obj_, "network-caching") * 1000;
+
+    // VLC asks once, when the input starts, before anything is known about the swarm or the media bitrate.
+    // Only tell whether the file is complete locally as far as we know, without waiting on the engine: a file
+    // still being checked gets the network caching. Slow swarms are compensated by the playhead window
+    // instead (see UpdatePlayheadWindow).
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+    if (!priorities_.empty() && priorities_.Complete())
+        return var_InheritInteger(obj_, "file-caching") * 1000;
+    return network_caching;
+}
+
+void PieceStreamer::ApplyPiecePriorities()
+{
+    std::vector<int> changed;
+
+    priorities_.Update(changed);
+    if (changed.empty())
+        return;
+
+    // Only update the pieces whose priority changed, unless most of them did.
+    // This avoids having libtorrent rescheduling the whole torrent every time.
+    const auto& priorities = priorities_.priorities();
+    if (changed.size() > priorities.size() / 4)
+        engine_.PrioritizePieces(priorities);
+    else {
+        for (const auto i : changed)
+            engine_.SetPiecePriority(i, priorities[i]);
+    }
+}
+
+uint64_t PieceStreamer::ConsumptionRate() const
+{
+    using namespace std::chrono;
+
+    // Estimate the media bitrate from the rate at which the demuxer consumes data.
+    // Return 0 until we have a meaningful estimate.
+    const auto elapsed = duration_cast<milliseconds>(steady_clock::now() - consumed_since_);
+    if (consumed_bytes_ == 0 || elapsed < seconds{1})
+        return 0;
+    return consumed_bytes_ * 1000 / elapsed.count();
+}
+
+void PieceStreamer::UpdateBackgroundDownload()
+{
+    if (background_threshold_.count() == 0 || layout_.piece_size == 0)
+        return;
+
+    // Keep the current state until we know how much is buffered ahead of the playhead.
+    const auto rate = ConsumptionRate();
+    if (rate == 0)
+        return;
+
+    const auto ahead_bytes = static_cast<uint64_t>(layout_.piece_size) * priorities_.ContiguousHave();
+    const auto ahead = std::chrono::milliseconds{ahead_bytes * 1000 / rate};
+
+    // Download the rest of the file only when the playhead is secure, with some hysteresis to avoid flapping.
+    if (!priorities_.background_download() && ahead >= background_threshold_)
+        priorities_.SetBackground(true);
+    else if (priorities_.background_download() && ahead < background_threshold_ / 2)
+        priorities_.SetBackground(false);
+}
+
+void PieceStreamer::UpdatePlayheadWindow()
+{
+    using namespace std::chrono;
+
+    // Download further ahead of the playhead when pieces arrive slower than the media plays, within reason.
+    const auto now = steady_clock::now();
+    if (layout_.piece_size == 0 || now - window_updated_ < seconds{1})
+        return;
+    const auto bitrate = ConsumptionRate();
+    if (bitrate == 0)
+        return;
+    window_updated_ = now;
+
+    const auto download_rate = static_cast<uint64_t>(engine_.status().download_rate);
+    window_factor_ = 1;
+    if (download_rate == 0)
+        window_factor_ = max_window_factor;
+    else if (download_rate < bitrate)
+        window_factor_ = static_cast<int>(std::min<uint64_t>(bitrate / download_rate + 1, max_window_factor));
+    ApplyPlayheadWindow();
+}
+
+// The window scaled for the swarm speed, and at least the pause buffer while paused.
+void PieceStreamer::ApplyPlayheadWindow()
+{
+    auto window = static_cast<int64_t>(playhead_window) * window_factor_;
+    if (paused_)
+        window = std::max<int64_t>(window, pause_window_);
+    priorities_.SetPlayheadWindow(std::max(static_cast<int>(window / layout_.piece_size), 1));
+}
+
+void PieceStreamer::HandlePieceFinished(int piece)
+{
+    msg_Dbg(obj_, "Piece finished: %d", piece);
+
+    availability_changed_ |= availability_.Set(piece);
+
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+    if (!priorities_.empty()) {
+        priorities_.SetHave(piece);
+        UpdateBackgroundDownload();
+        UpdatePlayheadWindow();
+        ApplyPiecePriorities();
+    }
+}
+
+void PieceStreamer::SetHavePieces(const std::vector<bool>& pieces)
+{
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        if (pieces[i])
+            availability_changed_ |= availability_.Set(i);
+    }
+
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+    if (!priorities_.empty()) {
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (pieces[i])
+                priorities_.SetHave(i);
+        }
+        UpdateBackgroundDownload();
+        UpdatePlayheadWindow();
+        ApplyPiecePriorities();
+    }
+}
+
+void PieceStreamer::PublishStats(vlc_object_t* p_input)
+{
+    if (layout_.piece_size == 0) // Not streaming yet.
+        return;
+
+    if (availability_changed_) {
+        var_SetString(p_input, "torrent-availability", availability_.bitmap().c_str());
+        availability_changed_ = false;
+    }
+    {
+        const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+        const auto ahead = static_cast<uint64_t>(layout_.piece_size) * priorities_.ContiguousHave();
+        const auto rate = ConsumptionRate();
+        var_SetInteger(p_input, "torrent-buffered-bytes", ahead);
+        var_SetInteger(p_input, "torrent-buffered-time", rate > 0 ? ahead * 1000 / rate : 0);
+    }
+    var_SetInteger(p_input, "torrent-stalls", metrics_.stalls);
+    if (metrics_.latency_count > 0) {
+        var_SetInteger(p_input, "torrent-piece-latency", metrics_.latency_sum / metrics_.latency_count);
+        var_SetInteger(p_input, "torrent-piece-latency-max", metrics_.latency_max);
+        metrics_.latency_sum = metrics_.latency_max = metrics_.latency_count = 0;
+    }
+}
+
+void PieceStreamer::HandleStateChanged(lts::state_t state)
+{
+    const char* msg;
+
+    switch (state) {
+#if LIBTORRENT_VERSION_NUM < 10200
+        case lts::queued_for_checking:
+            msg = "Queued for checking";
+            break;
+        case lts::allocating:
+            msg = "Allocating space";
+            break;
+#endif
+        case lts::downloading_metadata:
+            msg = "Downloading metadata";
+            break;
+        case lts::finished:
+            msg = "Finished";
+            break;
+        case lts::checking_resume_data:
+            msg = "Resuming";
+            break;
+        case lts::checking_files:
+            msg = "Checking files";
+            break;
+        case lts::seeding:
+            msg = "Seeding";
+            break;
+        case lts::downloading:
+            msg = "Downloading";
+            break;
+        default:
+            return;
+    }
+    msg_Info(obj_, "Torrent state changed to: %s", msg);
 
-#include "torrent.h"
+    const auto lock = std::unique_lock<std::mutex>{status_.mutex};
+    status_.state = state;
+    ready_.Signal();
+}
+
+void PieceStreamer::HandleReadPiece(const EngineEvent& event)
+{
+    if (event.data == nullptr) { // Read error, try again.
+        engine_.ReadPiece(event.piece);
+        return;
+    }
+
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+    cache_.Add(event.piece, event.data);
+
+    auto p = std::find_if(std::begin(queue_.pieces), std::end(queue_.pieces),
+      [&event](const Piece& p) { return event.piece == p.id; }
+    );
+    if (p == std::end(queue_.pieces) || p->data != nullptr)
+        return;
+
+    assert(event.size >= p->offset + p->length);
+    p->data = event.data;
+
+    if (p->requested) {
+        const auto latency = std::chrono::steady_clock::now() - p->requested_at;
+        const auto latency_ms = std::chrono::duration_cast<std::chrono::milliseconds>(latency).count();
+        metrics_.latency_sum += latency_ms;
+        metrics_.latency_max = std::max<uint64_t>(metrics_.latency_max, latency_ms);
+        ++metrics_.latency_count;
+        metrics_.piece_latency.Add(std::chrono::duration_cast<std::chrono::microseconds>(latency));
+    }
+    if (p->id == queue_.pieces.front().id)
+        ready_.Signal();
+}
+
+void PieceStreamer::ReadNextPiece(Piece& piece, bool& eof, uint64_t max_length)
+{
+    eof = false;
+
+    // Clear the event before looking for something to read so that we can't miss a signal.
+    ready_.Clear();
+    {
+        const auto lock = std::unique_lock<std::mutex>{status_.mutex};
+        const auto s = status_.state;
+        if (s != lts::downloading && s != lts::finished && s != lts::seeding)
+            return;
+    }
+
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+    if (queue_.pieces.empty()) {
+        eof = true;
+        return;
+    }
+    RequestPieces(block_size_);
+    if (queue_.pieces.front().data == nullptr)
+        return;
+
+    PopNextPiece(piece, max_length);
+}
+
+bool PieceStreamer::ReadReadyPiece(Piece& piece, uint64_t max_length)
+{
+    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
+
+    if (queue_.pieces.empty() || queue_.pieces.front().data == nullptr)
+        return false;
+    PopNextPiece(piece, max_length);
+    return true;
+}
+
+void PieceStreamer::RequestPieces(uint64_t size)
+{
+    auto total = uint64_t{0};
+
+    // Always request the next piece, then request the following ones we already have up to the given size.
+    for (auto& p : queue_.pieces) {
+        if (total > 0 && (total >= size || !priorities_.have(p.id)))
+            break;
+        total += p.length;
+
+        if (p.requested)
+            continue;
+        engine_.SetPieceDeadline(p.id);
+        p.requested = true;
+        p.requested_at = std::chrono::steady_clock::now();
+        msg_Dbg(obj_, "Piece requested: %d", p.id);
+    }
+}
+
+void PieceStreamer::PopNextPiece(Piece& piece, uint64_t max_length)
+{
+    auto& next_piece = queue_.pieces.front();
+
+    // Hand out a slice of the piece if it is too large, the remainder stays in queue.
+    if (static_cast<uint64_t>(next_piece.length) > max_length) {
+        piece.id = next_piece.id;
+        piece.offset = next_piece.offset;
+        piece.length = max_length;
+        piece.requested = true;
+        piece.data = next_piece.data;
+        next_piece.offset += piece.length;
+        next_piece.length -= piece.length;
+        consumed_bytes_ += piece.length;
+        return;
+    }
+
+    piece = std::move(next_piece);
+    queue_.pieces.pop_front();
+    msg_Dbg(obj_, "Got piece: %d", piece.id);
+    consumed_bytes_ += piece.length;
+
+    // Slide the playhead window forward.
+    if (!queue_.pieces.empty())
+        priorities_.MovePlayhead(queue_.pieces.front().id);
+    UpdateBackgroundDownload();
+    UpdatePlayheadWindow();
+    ApplyPiecePriorities();
+    RequestPieces(block_size_);
+}
+
+// Peers saved by TorrentAccess::SavePeers, as a list of {ip, port} dictionaries.
+static std::vector<lt::tcp::endpoint> LoadPeers(const std::vector<char>& buf)
+{
+    std::vector<lt::tcp::endpoint> peers;
+    lt::error_code ec;
+
+    if (buf.empty())
+        return peers;
+
+    const auto add_peer = [&peers, &ec](const std::string& ip, int64_t port) {
+#if LIBTORRENT_VERSION_NUM >= 10200
+        const auto address = lt::make_address(ip, ec);
+#else
+        const auto address = lt::address::from_string(ip, ec);
+#endif
+        if (!ec && port > 0 && port < 65536)
+            peers.emplace_back(address, static_cast<unsigned short>(port));
+    };
+
+#if LIBTORRENT_VERSION_NUM >= 10100
+    lt::bdecode_node list;
+    if (lt::bdecode(buf.data(), buf.data() + buf.size(), list, ec) || ec || list.type() != lt::bdecode_node::list_t)
+        return peers;
+    for (auto i = 0; i < list.list_size(); ++i) {
+        const auto peer = list.list_at(i);
+        if (peer.type() == lt::bdecode_node::dict_t)
+            add_peer(std::string(peer.dict_find_string_value("ip")), peer.dict_find_int_value("port"));
+    }
+#else
+    lt::lazy_entry list;
+    if (lt::lazy_bdecode(buf.data(), buf.data() + buf.size(), list, ec) || ec || list.type() != lt::lazy_entry::list_t)
+        return peers;
+    for (auto i = 0; i < list.list_size(); ++i) {
+        const auto peer = list.list_at(i);
+        if (peer->type() == lt::lazy_entry::dict_t)
+            add_peer(peer->dict_find_string_value("ip"), peer->dict_find_int_value("port"));
+    }
+#endif
+    return peers;
+}
 
 TorrentAccess::~TorrentAccess()
 {
     const auto keep_files = var_InheritBool(access_, "keep-files");
 
-    session_.pause();
-    if (handle_.is_valid()) {
+    closing_ = true;
+    if (engine_.has_torrent())
+        SavePeers(); // Before the session is paused and the peers disconnected.
+    engine_.session().pause();
+    if (engine_.has_torrent()) {
         SaveSessionStates(keep_files);
-        if (keep_files)
-            session_.remove_torrent(handle_);
-        else {
-            session_.remove_torrent(handle_, lt::session::delete_files);
+        engine_.RemoveTorrent(!keep_files);
+        if (!keep_files)
             CacheDel(torrent_hash() + ".torrent");
-        }
     }
 
     stopped_ = true;
-    if (thread_.joinable())
+    if (thread_.joinable()) {
         thread_.join();
+        DumpStats();
+        if (auto p_input = access_GetParentInput(access_)) {
+            for (const auto& v : input_vars)
+                var_Destroy(p_input, v.name);
+            vlc_object_release(p_input);
+        }
+    }
 }
 
 void TorrentAccess::SaveSessionStates(bool save_resume_data) const
@@ -72,11 +1216,7 @@ void TorrentAccess::SaveSessionStates(bool save_resume_data) const
     // If we need to save the resume data as well, do it in a separate thread.
     try {
         const auto policy = save_resume_data ? std::launch::async : std::launch::deferred;
-        dht_state_saved = std::async(policy, [this]{
-            lt::entry state;
-            session_.save_state(state, lt::session::save_dht_state);
-            CacheSave("dht_state.dat", state);
-        });
+        dht_state_saved = std::async(policy, [this]{ SaveDHTState(); });
     }
     catch (std::system_error&) {}
 
@@ -84,7 +1224,7 @@ void TorrentAccess::SaveSessionStates(bool save_resume_data) const
     // The actual saving process is done by the main thread (see Run/HandleSaveResumeData).
     if (save_resume_data) {
         const auto resume_data_saved = resume_data_saved_.get_future();
-        handle_.save_resume_data(lth::flush_disk_cache);
+        engine_.handle().save_resume_data(lth::flush_disk_cache);
         resume_data_saved.wait();
     }
 
@@ -92,6 +1232,47 @@ void TorrentAccess::SaveSessionStates(bool save_resume_data) const
         dht_state_saved.wait();
 }
 
+void TorrentAccess::SaveDHTState() const
+{
+    // Don't replace the routing table saved with an empty one, e.g. when none of its nodes answered.
+    if (engine_.dht_nodes() == 0)
+        return;
+
+    const auto lock = std::unique_lock<std::mutex>{dht_state_mutex_};
+#if LIBTORRENT_VERSION_NUM >= 20000
+    const auto params = engine_.session().session_state(lt::session::save_dht_state);
+    CacheSave("dht_state.dat", lt::write_session_params(params, lt::session::save_dht_state));
+#else
+    lt::entry state;
+    engine_.session().save_state(state, lt::session::save_dht_state);
+    CacheSave("dht_state.dat", state);
+#endif
+}
+
+void TorrentAccess::SavePeers() const
+{
+    auto peers = engine_.BestPeers(max_saved_peers);
+
+    // Keep the peers of the previous sessions we didn't reach this time.
+    for (const auto& p : saved_peers_) {
+        if (peers.size() >= max_saved_peers)
+            break;
+        if (std::find(std::begin(peers), std::end(peers), p) == std::end(peers))
+            peers.push_back(p);
+    }
+    if (peers.empty())
+        return;
+
+    lt::entry list{lt::entry::list_t};
+    for (const auto& p : peers) {
+        lt::entry peer{lt::entry::dictionary_t};
+        peer["ip"] = p.address().to_string();
+        peer["port"] = lt::entry::integer_type{p.port()};
+        list.list().push_back(peer);
+    }
+    CacheSave(torrent_hash() + ".peers", list);
+}
+
 int TorrentAccess::ParseURI(const std::string& uri, lt::add_torrent_params& params)
 {
     lt::error_code ec;
@@ -126,20 +1307,25 @@ int TorrentAccess::RetrieveTorrentMetadata()
         }
     }
 
-    session_.set_alert_mask(lta::status_notification);
-    session_.add_extension(&lt::create_metadata_plugin);
-    session_.add_extension(&lt::create_ut_metadata_plugin);
-    handle_ = session_.add_torrent(params_, ec);
-    if (ec)
+    SetAlertMask(false);
+#if LIBTORRENT_VERSION_NUM < 10100
+    auto& session = engine_.session();
+    session.add_extension(&lt::create_metadata_plugin);
+    session.add_extension(&lt::create_ut_metadata_plugin);
+#endif
+    StartSession(); // The metadata lookup relies on the DHT as much as the download.
+    if (engine_.AddTorrent(params_) != VLC_SUCCESS)
         return VLC_EGENERIC;
 
     Run();
-    session_.remove_torrent(handle_);
+    const auto metadata = engine_.handle().torrent_file();
+    engine_.RemoveTorrent(false);
+    if (metadata == nullptr)
+        return VLC_EGENERIC;
 
     // Create the torrent file and save it in cache.
-    const auto& metadata = handle_.get_torrent_info();
-    set_torrent_metadata(metadata); // XXX must happen before create_torrent (create_torrent const_cast its args ...)
-    const auto torrent = lt::create_torrent{metadata};
+    set_torrent_metadata(*metadata); // XXX must happen before create_torrent (create_torrent const_cast its args ...)
+    const auto torrent = lt::create_torrent{*metadata};
     path = CacheSave(filename, torrent.generate());
     if (path.empty())
         return VLC_EGENERIC;
@@ -151,53 +1337,255 @@ int TorrentAccess::RetrieveTorrentMetadata()
 int TorrentAccess::StartDownload(int file_at)
 {
     lt::error_code ec;
-    lt::lazy_entry entry;
 
     assert(has_torrent_metadata() && file_at >= 0 && download_dir_ != nullptr);
 
-    session_.set_alert_mask(lta::status_notification | lta::storage_notification | lta::progress_notification);
-    session_.add_extension(&lt::create_ut_pex_plugin);
-    session_.add_extension(&lt::create_smart_ban_plugin);
-    SetSessionSettings();
+    SetAlertMask(true);
+    StartSession();
 
-    // Start the DHT
-    auto buf = CacheLoad("dht_state.dat");
-    if (buf.size() > 0 && !lazy_bdecode(buf.data(), buf.data() + buf.size(), entry, ec) && !ec)
-        session_.load_state(entry);
-    session_.start_dht();
+    params_.save_path = download_dir_.get();
+    params_.storage_mode = lt::storage_mode_allocate;
 
     // Attempt to fast resume the torrent.
-    buf = CacheLoad(torrent_hash() + ".resume");
+    auto buf = CacheLoad(torrent_hash() + ".resume");
+#if LIBTORRENT_VERSION_NUM >= 10200
+    if (buf.size() > 0) {
+        auto params = lt::read_resume_data(buf, ec);
+        if (!ec) {
+            // The resume data replaces the parameters, keep those of the URI it doesn't carry.
+            params.ti = params_.ti;
+            params.save_path = params_.save_path;
+            params.storage_mode = params_.storage_mode;
+            if (params.trackers.empty()) {
+                params.trackers = std::move(params_.trackers);
+                params.tracker_tiers = std::move(params_.tracker_tiers);
+            }
+            if (params.url_seeds.empty())
+                params.url_seeds = std::move(params_.url_seeds);
+            if (params.dht_nodes.empty())
+                params.dht_nodes = std::move(params_.dht_nodes);
+            params_ = std::move(params);
+        }
+    }
+#elif LIBTORRENT_VERSION_NUM >= 10100
     if (buf.size() > 0)
-#if LIBTORRENT_VERSION_MAJOR > 0
         params_.resume_data = std::move(buf);
 #else
+    if (buf.size() > 0)
         params_.resume_data = &buf;
 #endif
 
-    params_.save_path = download_dir_.get();
-    params_.storage_mode = lt::storage_mode_allocate;
-    handle_ = session_.add_torrent(params_, ec);
-    if (ec)
+    if (engine_.AddTorrent(params_) != VLC_SUCCESS)
         return VLC_EGENERIC;
 
+    // Reconnect to the best peers of the previous sessions without waiting for the trackers and the DHT.
+    saved_peers_ = LoadPeers(CacheLoad(torrent_hash() + ".peers"));
+    for (const auto& p : saved_peers_)
+        engine_.ConnectPeer(p);
+    if (!saved_peers_.empty())
+        msg_Dbg(access_, "Connecting to %zu known peers", saved_peers_.size());
+
+    const auto& metadata = torrent_metadata();
+    const auto& files = metadata.files();
+    if (streamer_.Start({metadata.num_pieces(), metadata.piece_length(),
+                         static_cast<uint64_t>(files.file_offset(file_index(file_at))),
+                         static_cast<uint64_t>(files.file_size(file_index(file_at)))}) != VLC_SUCCESS)
+        return VLC_EGENERIC;
     file_at_ = file_at;
-    SelectPieces(0);
-    handle_.set_sequential_download(true);
-    status_.state = handle_.status().state;
+
+    // Publish the streaming metrics.
+    if (auto p_input = access_GetParentInput(access_)) {
+        for (const auto& v : input_vars)
+            var_Create(p_input, v.name, v.type);
+        vlc_object_release(p_input);
+    }
 
     thread_ = std::thread{&TorrentAccess::Run, this};
     return VLC_SUCCESS;
 }
 
+void TorrentAccess::StartSession()
+{
+    if (session_started_)
+        return;
+
+#if LIBTORRENT_VERSION_NUM < 10100
+    auto& session = engine_.session();
+    session.add_extension(&lt::create_ut_pex_plugin);   // Part of the default plugins since 1.1.
+    session.add_extension(&lt::create_smart_ban_plugin);
+#endif
+    SetSessionSettings();
+    StartDHT();
+    session_started_ = true;
+}
+
+void TorrentAccess::StartDHT()
+{
+    auto& session = engine_.session();
+    lt::error_code ec;
+    auto loaded = false;
+
+    // Bootstrap from the routing table saved, the routers are only a fallback (see MaintainDHT).
+    const auto buf = CacheLoad("dht_state.dat");
+#if LIBTORRENT_VERSION_NUM >= 20000
+    // The DHT state can't be loaded in a running session anymore, bootstrap from its nodes instead.
+    lt::bdecode_node state;
+    if (buf.size() > 0 && !lt::bdecode(buf.data(), buf.data() + buf.size(), state, ec) && !ec) {
+        const auto params = lt::read_session_params(state, lt::session::save_dht_state);
+        for (const auto& nodes : {params.dht_state.nodes, params.dht_state.nodes6}) {
+            for (const auto& n : nodes) {
+                session.add_dht_node({n.address().to_string(), n.port()});
+                loaded = true;
+            }
+        }
+    }
+#elif LIBTORRENT_VERSION_NUM >= 10100
+    lt::bdecode_node state;
+    if (buf.size() > 0 && !lt::bdecode(buf.data(), buf.data() + buf.size(), state, ec) && !ec) {
+        session.load_state(state);
+        loaded = true;
+    }
+#else
+    lt::lazy_entry state;
+    if (buf.size() > 0 && !lazy_bdecode(buf.data(), buf.data() + buf.size(), state, ec) && !ec) {
+        session.load_state(state);
+        loaded = true;
+    }
+    session.start_dht();
+#endif
+
+    dht_started_ = std::chrono::steady_clock::now();
+    dht_checked_ = dht_started_;
+    dht_saved_ = dht_started_;
+    if (!loaded)
+        AddDHTRouters();
+}
+
+void TorrentAccess::AddDHTRouters()
+{
+    msg_Dbg(access_, "Bootstrapping the DHT from the routers");
+#if LIBTORRENT_VERSION_NUM >= 10100
+    std::ostringstream nodes;
+    for (const auto& r : dht_routers)
+        nodes << (&r == dht_routers ? "" : ",") << r.host << ":" << r.port;
+
+    lt::settings_pack s;
+    s.set_str(lt::settings_pack::dht_bootstrap_nodes, nodes.str());
+    engine_.session().apply_settings(s);
+#else
+    for (const auto& r : dht_routers)
+        engine_.session().add_dht_router({r.host, r.port});
+#endif
+    dht_routers_added_ = true;
+}
+
+void TorrentAccess::MaintainDHT()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    if (!session_started_ || now - dht_checked_ < std::chrono::seconds{1})
+        return;
+    dht_checked_ = now;
+
+    const auto nodes = engine_.dht_nodes();
+    engine_.UpdateSessionStats(); // For the next round.
+
+    // None of the nodes saved answered, fall back to the routers.
+    if (!dht_routers_added_ && nodes == 0 && now - dht_started_ >= dht_bootstrap_timeout)
+        AddDHTRouters();
+
+    // Checkpoint the routing table as it changes, the destructor saves it one last time when closing.
+    if (!closing_ && nodes > 0 && nodes != dht_saved_nodes_ && now - dht_saved_ >= dht_checkpoint_interval) {
+        SaveDHTState();
+        dht_saved_ = now;
+        dht_saved_nodes_ = nodes;
+    }
+}
+
+void TorrentAccess::SetAlertMask(bool downloading)
+{
+    auto& session = engine_.session();
+
+    // State changes, plus piece completions and reads once downloading.
+#if LIBTORRENT_VERSION_NUM >= 10200
+    auto mask = lt::alert_category::status;
+    if (downloading)
+        mask |= lt::alert_category::storage | lt::alert_category::piece_progress;
+#else
+    auto mask = static_cast<int>(lta::status_notification);
+    if (downloading)
+        mask |= lta::storage_notification | lta::progress_notification;
+#endif
+
+#if LIBTORRENT_VERSION_NUM >= 10100
+    lt::settings_pack s;
+    s.set_int(lt::settings_pack::alert_mask, mask);
+    session.apply_settings(s);
+#else
+    session.set_alert_mask(mask);
+#endif
+}
+
 void TorrentAccess::SetSessionSettings()
 {
-    auto s = session_.settings();
+    auto& session = engine_.session();
 
     const auto upload_rate = var_InheritInteger(access_, "upload-rate-limit");
     const auto download_rate = var_InheritInteger(access_, "download-rate-limit");
     const auto share_ratio = var_InheritFloat(access_, "share-ratio-limit");
     const auto user_agent = unique_char_ptr{var_InheritString(access_, "user-agent"), std::free};
+    const auto profile_name = unique_char_ptr{var_InheritString(access_, "torrent-profile"), std::free};
+
+    auto profile = std::begin(profiles);
+    if (profile_name != nullptr) {
+        profile = std::find_if(std::begin(profiles), std::end(profiles), [&](const StreamingProfile& p) {
+            return !strcmp(p.name, profile_name.get());
+        });
+        if (profile == std::end(profiles)) {
+            msg_Warn(access_, "Unknown torrent profile %s, using %s", profile_name.get(), profiles[0].name);
+            profile = std::begin(profiles);
+        }
+    }
+    msg_Dbg(access_, "Using the %s torrent profile", profile->name);
+#if LIBTORRENT_VERSION_NUM >= 20000
+    disk_tuner_ = {profile->disk_queue[0], profile->disk_queue[1], 0, 0};
+#else
+    disk_tuner_ = {profile->disk_queue[0], profile->disk_queue[1], profile->cache_size[0], profile->cache_size[1]};
+#endif
+
+#if LIBTORRENT_VERSION_NUM >= 10100
+    lt::settings_pack s;
+
+    s.set_str(lt::settings_pack::user_agent, std::string{user_agent.get()} + "/" VERSION " libtorrent/" LIBTORRENT_VERSION);
+    s.set_int(lt::settings_pack::active_downloads, 1);
+    s.set_int(lt::settings_pack::active_seeds, 1);
+    s.set_bool(lt::settings_pack::announce_to_all_trackers, true);
+    s.set_bool(lt::settings_pack::use_dht_as_fallback, false);
+    s.set_int(lt::settings_pack::initial_picker_threshold, 0);
+#if LIBTORRENT_VERSION_NUM < 10200
+    s.set_bool(lt::settings_pack::no_atime_storage, true);               // Always on since 1.2.
+#endif
+    s.set_bool(lt::settings_pack::no_recheck_incomplete_resume, true);
+    s.set_int(lt::settings_pack::max_queued_disk_bytes, disk_tuner_.disk_queue());
+#if LIBTORRENT_VERSION_NUM < 20000
+    s.set_int(lt::settings_pack::cache_size, disk_tuner_.cache_size()); // Files are memory mapped since 2.0.
+    s.set_int(lt::settings_pack::torrent_connect_boost, profile->num_want / 10);
+#endif
+    s.set_int(lt::settings_pack::aio_threads, profile->aio_threads);
+    s.set_int(lt::settings_pack::request_queue_time, profile->request_queue_time);
+    s.set_int(lt::settings_pack::max_out_request_queue, profile->max_out_request_queue);
+    s.set_int(lt::settings_pack::connections_limit, profile->connections_limit);
+    s.set_int(lt::settings_pack::max_peerlist_size, profile->max_peerlist_size);
+    s.set_int(lt::settings_pack::num_want, profile->num_want);
+    s.set_int(lt::settings_pack::share_ratio_limit, static_cast<int>(share_ratio * 100)); // In percents.
+    s.set_int(lt::settings_pack::upload_rate_limit, upload_rate * 1024);
+    s.set_int(lt::settings_pack::download_rate_limit, download_rate * 1024);
+    s.set_bool(lt::settings_pack::enable_dht, true);
+    s.set_str(lt::settings_pack::dht_bootstrap_nodes, "");              // Routers are added by AddDHTRouters.
+
+    session.apply_settings(s);
+#else
+    auto s = session.settings();
 
     s.user_agent = std::string{user_agent.get()} + "/" VERSION " libtorrent/" LIBTORRENT_VERSION;
     s.active_downloads = 1;
@@ -207,201 +1595,130 @@ void TorrentAccess::SetSessionSettings()
     s.initial_picker_threshold = 0;               // Pieces to pick at random before doing rarest first picking.
     s.no_atime_storage = true;                    // Linux only O_NOATIME.
     s.no_recheck_incomplete_resume = true;        // Don't check the file when resume data is incomplete.
-    s.max_queued_disk_bytes = 2 * 1024 * 1024;    // I/O thread buffer queue in bytes (may limit the download rate).
-    s.cache_size = -1;                            // Disk read/write cache specified in units of 16 KiB (-1 for RAM/8).
-    s.max_peerlist_size = 3000;                   // Maximum number of peers per torrent.
-    s.num_want = 200;                             // Number of peers requested per tracker.
+    s.max_queued_disk_bytes = disk_tuner_.disk_queue();
+    s.cache_size = disk_tuner_.cache_size();
+    s.aio_threads = profile->aio_threads;
+    s.request_queue_time = profile->request_queue_time;
+    s.max_out_request_queue = profile->max_out_request_queue;
+    s.connections_limit = profile->connections_limit;
+    s.max_peerlist_size = profile->max_peerlist_size;
+    s.num_want = profile->num_want;
     s.torrent_connect_boost = s.num_want / 10;    // Number of peers to try to connect to immediately.
     s.share_ratio_limit = share_ratio;            // Share ratio limit (uploaded bytes / downloaded bytes).
     s.upload_rate_limit = upload_rate * 1024;     // Limits the upload speed in bytes/sec.
     s.download_rate_limit = download_rate * 1024; // Limits the download speed in bytes/sec.
 
-    session_.set_settings(s);
-
-    const auto routers = std::unordered_map<std::string, int>{
-        {"router.bittorrent.com", 6881},
-        {"router.utorrent.com", 6881},
-        {"router.bitcomet.com", 6881}
-    };
-    for (const auto& r : routers)
-        session_.add_dht_router(r);
+    session.set_settings(s);
+#endif
 }
 
 void TorrentAccess::Run()
 {
-    std::deque<lt::alert*> alerts;
+    std::vector<EngineEvent> events;
 
     while (!stopped_) {
-        if (!session_.wait_for_alert(lt::seconds(1)))
+        PublishStats();
+        MaintainDHT();
+        TuneDiskSettings();
+        events.clear();
+        if (!engine_.PopEvents(std::chrono::seconds{1}, events))
             continue;
 
-        session_.pop_alerts(&alerts);
-        for (const auto alert : alerts) {
-            switch (alert->type()) {
-                case lt::piece_finished_alert::alert_type: {
-                    const auto a = lt::alert_cast<lt::piece_finished_alert>(alert);
-                    msg_Dbg(access_, "Piece finished: %d", a->piece_index);
-                    break;
-                }
-                case lt::state_changed_alert::alert_type:
-                    HandleStateChanged(alert);
+        for (const auto& e : events) {
+            switch (e.type) {
+                case EngineEvent::resume_data_saved:
+                    HandleSaveResumeData(e);
                     break;
-                case lt::save_resume_data_alert::alert_type:
-                    HandleSaveResumeData(alert);
-                    break;
-                case lt::read_piece_alert::alert_type:
-                    HandleReadPiece(alert);
-                    break;
-                case lt::metadata_received_alert::alert_type: // Magnet file only.
+                case EngineEvent::metadata_received:
                     return;
+                default:
+                    streamer_.HandleEvent(e);
+                    break;
             }
         }
-        alerts.clear();
     }
 }
 
-void TorrentAccess::SelectPieces(uint64_t offset)
+void TorrentAccess::PublishStats()
 {
-    assert(has_torrent_metadata() && file_at_ >= 0);
-
-    const auto& metadata = torrent_metadata();
-    const auto& file = metadata.file_at(file_at_);
-
-    const auto piece_size = metadata.piece_length();
-    const auto num_pieces = metadata.num_pieces();
-    const auto beg_req = metadata.map_file(file_at_, offset, 1);
-    const auto end_req = metadata.map_file(file_at_, file.size - 1, 1);
+    const auto now = std::chrono::steady_clock::now();
 
-    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
-    queue_.pieces.clear();
+    // Publish at most once per second, and only once the download started and until it stops.
+    if (file_at_ < 0 || closing_ || now - stats_published_ < std::chrono::seconds{1})
+        return;
 
-    if (offset == file.size)
+    auto p_input = access_GetParentInput(access_);
+    if (p_input == nullptr)
         return;
 
-    for (auto i = 0; i < num_pieces; ++i) {
-        if (i < beg_req.piece || i > end_req.piece) {
-            handle_.piece_priority(i, 0); // Discard unwanted pieces.
-            continue;
-        }
+    streamer_.PublishStats(VLC_OBJECT(p_input));
 
-        auto off = 0;
-        auto len = piece_size;
-        if (i == beg_req.piece) { // First piece.
-            off = beg_req.start;
-            len = piece_size - off;
-        }
-        if (i == end_req.piece) // Last piece.
-            len = end_req.start + 1 - off;
+    const auto status = engine_.status();
+    var_SetInteger(p_input, "torrent-download-rate", status.download_rate);
+    var_SetInteger(p_input, "torrent-upload-rate", status.upload_rate);
+    var_SetInteger(p_input, "torrent-peers", status.num_peers);
 
-        handle_.piece_priority(i, 7);
-        queue_.pieces.emplace_back(i, off, len);
-    }
+    vlc_object_release(p_input);
+    stats_published_ = now;
 }
 
-void TorrentAccess::HandleStateChanged(const lt::alert* alert)
+void TorrentAccess::TuneDiskSettings()
 {
-    const auto a = lt::alert_cast<lt::state_changed_alert>(alert);
-    const char* msg;
+    const auto now = std::chrono::steady_clock::now();
 
-    switch (a->state) {
-        case lts::queued_for_checking:
-            msg = "Queued for checking";
-            break;
-        case lts::downloading_metadata:
-            msg = "Downloading metadata";
-            break;
-        case lts::finished:
-            msg = "Finished";
-            break;
-        case lts::allocating:
-            msg = "Allocating space";
-            break;
-        case lts::checking_resume_data:
-            msg = "Resuming";
-            break;
-        case lts::checking_files:
-            msg = "Checking files";
-            break;
-        case lts::seeding:
-            msg = "Seeding";
-            break;
-        case lts::downloading:
-            msg = "Downloading";
-            break;
-        default:
-            return;
-    }
-    msg_Info(access_, "Torrent state changed to: %s", msg);
+    // Leave the session alone while it is paused and the torrent removed.
+    if (file_at_ < 0 || closing_ || now - disk_tuned_ < std::chrono::seconds{1})
+        return;
+    disk_tuned_ = now;
 
-    const auto lock = std::unique_lock<std::mutex>{status_.mutex};
-    status_.state = a->state;
-    status_.cond.notify_one();
+    const auto queued_bytes = engine_.disk_queued_bytes(); // Sampled along with the DHT nodes (see MaintainDHT).
+    if (!disk_tuner_.Update(engine_.status().download_rate, queued_bytes))
+        return;
+
+    msg_Dbg(access_, "Disk queue %d KiB, cache %d KiB (%" PRId64 " KiB queued)", disk_tuner_.disk_queue() / 1024,
+            disk_tuner_.cache_size() * 16, queued_bytes / 1024);
+
+    auto& session = engine_.session();
+#if LIBTORRENT_VERSION_NUM >= 10100
+    lt::settings_pack s;
+    s.set_int(lt::settings_pack::max_queued_disk_bytes, disk_tuner_.disk_queue());
+# if LIBTORRENT_VERSION_NUM < 20000
+    s.set_int(lt::settings_pack::cache_size, disk_tuner_.cache_size());
+# endif
+    session.apply_settings(s);
+#else
+    auto s = session.settings();
+    s.max_queued_disk_bytes = disk_tuner_.disk_queue();
+    s.cache_size = disk_tuner_.cache_size();
+    session.set_settings(s);
+#endif
 }
 
-void TorrentAccess::HandleSaveResumeData(const lt::alert* alert) const
+void TorrentAccess::HandleSaveResumeData(const EngineEvent& event) const
 {
-    const auto a = lt::alert_cast<lt::save_resume_data_alert>(alert);
-
-    if (a->resume_data != nullptr)
-        CacheSave(torrent_hash() + ".resume", *a->resume_data);
+    if (event.resume_data != nullptr)
+        CacheSave(torrent_hash() + ".resume", *event.resume_data);
     resume_data_saved_.set_value();
 }
 
-void TorrentAccess::HandleReadPiece(const lt::alert* alert)
+void TorrentAccess::DumpStats() const
 {
-    const auto a = lt::alert_cast<lt::read_piece_alert>(alert);
-
-    if (a->buffer == nullptr) { // Read error, try again.
-        handle_.read_piece(a->piece);
-        return;
-    }
-
-    const auto lock = std::unique_lock<std::mutex>{queue_.mutex};
-
-    auto p = std::find_if(std::begin(queue_.pieces), std::end(queue_.pieces),
-      [a](const Piece& p) { return a->piece == p.id; }
-    );
-    if (p == std::end(queue_.pieces) || p->data != nullptr)
+    std::ostringstream os;
+    const auto& metrics = streamer_.metrics();
+    metrics.piece_latency.Dump(os, "piece latency", false);
+    metrics.read_wait.Dump(os, "read wait", false);
+    msg_Info(access_, "Streaming statistics (%" PRIu64 " stalls):\n%s", metrics.stalls.load(), os.str().c_str());
+
+    const auto path = unique_char_ptr{var_InheritString(access_, "torrent-stats-file"), std::free};
+    if (path == nullptr)
         return;
 
-    assert(a->size >= p->length);
-    p->data = {block_Alloc(p->length), block_Release};
-    std::memcpy(p->data->p_buffer, a->buffer.get() + p->offset, p->length);
-    if (p->id == queue_.pieces.front().id)
-        queue_.cond.notify_one();
-}
-
-void TorrentAccess::ReadNextPiece(Piece& piece, bool& eof)
-{
-    const auto timeout = std::chrono::milliseconds{500};
-    eof = false;
-
-    {
-        auto lock = std::unique_lock<std::mutex>{status_.mutex};
-        const auto cond = status_.cond.wait_for(lock, timeout, [&s = status_.state]{
-                return s == lts::downloading || s == lts::finished || s == lts::seeding;
-        });
-        if (!cond)
-            return;
-    }
-
-    auto lock = std::unique_lock<std::mutex>{queue_.mutex};
-    if (queue_.pieces.empty()) {
-        eof = true;
-        return;
-    }
-    auto& next_piece = queue_.pieces.front();
-    if (!next_piece.requested) {
-        handle_.set_piece_deadline(next_piece.id, 0, lth::alert_when_available);
-        next_piece.requested = true;
-        msg_Dbg(access_, "Piece requested: %d", next_piece.id);
-    }
-    if (!queue_.cond.wait_for(lock, timeout, [&next_piece]{ return next_piece.data != nullptr; }))
+    std::ofstream file{path.get(), std::ios_base::app};
+    if (!file)
         return;
-
-    piece = std::move(next_piece);
-    queue_.pieces.pop_front();
-    msg_Dbg(access_, "Got piece: %d", piece.id);
+    file << "torrent: " << torrent_hash() << " stalls: " << metrics.stalls << "\n";
+    metrics.piece_latency.Dump(file, "piece latency", true);
+    metrics.read_wait.Dump(file, "read wait", true);
 }
 
 std::string TorrentAccess::CacheSave(const std::string& name, const lt::entry& entry) const
@@ -409,12 +1726,19 @@ std::string TorrentAccess::CacheSave(const std::string& name, const lt::entry& e
     if (cache_dir_ == nullptr)
         return {};
 
+    // Write a temporary file renamed over the previous one, so that readers never see a partial file.
     const auto path = std::string{cache_dir_.get()} + DIR_SEP + name;
-    std::ofstream file{path, std::ios_base::binary | std::ios_base::trunc};
+    const auto tmp_path = path + ".tmp";
+    std::ofstream file{tmp_path, std::ios_base::binary | std::ios_base::trunc};
     if (!file)
         return {};
 
     lt::bencode(std::ostream_iterator<char>{file}, entry);
+    file.close();
+    if (!file || vlc_rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return {};
+    }
     return path;
 }
 
@@ -18,15 +18,25 @@
  * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
  *****************************************************************************/
 
+#ifndef TORRENT_H
+#define TORRENT_H
+
 #include <string>
 #include <cstdlib>
+#include <array>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <fstream>
 #include <memory>
 #include <deque>
+#include <vector>
 #include <atomic>
 #include <thread>
 #include <mutex>
-#include <future>
 #include <condition_variable>
+#include <future>
+#include <chrono>
 
 #include <vlc_common.h>
 #include <vlc_access.h>
@@ -38,13 +48,29 @@
 #include <libtorrent/torrent_info.hpp>
 #include <libtorrent/add_torrent_params.hpp>
 
+#include <boost/shared_array.hpp>
+
 namespace lt = libtorrent;
 
 using lta = lt::alert;
 using lts = lt::torrent_status;
 using lth = lt::torrent_handle;
 using unique_char_ptr = std::unique_ptr<char, void (*)(void*)>;
-using unique_block_ptr = std::unique_ptr<block_t, void (*)(block_t*)>;
+using time_point = std::chrono::steady_clock::time_point;
+
+// Read length meaning no limit, pieces are handed out whole.
+static const auto whole_piece = std::numeric_limits<uint64_t>::max();
+
+// Piece and file indices are strong types since libtorrent 1.2.
+#if LIBTORRENT_VERSION_NUM >= 10200
+using piece_index = lt::piece_index_t;
+using file_index = lt::file_index_t;
+using piece_priority = lt::download_priority_t;
+#else
+using piece_index = int;
+using file_index = int;
+using piece_priority = int;
+#endif
 
 struct Piece
 {
@@ -53,31 +79,389 @@ struct Piece
         id{i},
         offset{off},
         length{len},
-        requested{false},
-        data{nullptr, block_Release}
+        requested{false}
     {}
 
-    int              id;
-    int              offset;
-    int              length;
-    bool             requested;
-    unique_block_ptr data;
+    int                       id;
+    int                       offset;
+    int                       length;
+    bool                      requested;
+    time_point                requested_at;
+    boost::shared_array<char> data; // Whole piece buffer as read by libtorrent, shared between slices.
 };
 
 struct PiecesQueue
 {
     std::mutex              mutex;
-    std::condition_variable cond;
     std::deque<Piece>       pieces;
 };
 
 struct Status
 {
+    Status() : state{lts::checking_files} {}
+
     std::mutex              mutex;
-    std::condition_variable cond;
     lts::state_t            state;
 };
 
+// Histogram of durations with fixed buckets, cheap and lock-free to update.
+// Buckets are logarithmic with 4 linear sub-buckets per power of two, so values are known within 25%.
+class Histogram
+{
+    public:
+        Histogram();
+
+        void Add(std::chrono::microseconds d);
+        std::chrono::microseconds Percentile(double p) const;
+        uint64_t count() const;
+        void Dump(std::ostream& os, const char* name, bool buckets) const;
+
+    private:
+        static const auto num_buckets = 4 * 64;
+
+        static size_t BucketOf(uint64_t us);
+        static uint64_t LowerBound(size_t bucket);
+
+        std::array<std::atomic<uint64_t>, num_buckets> buckets_;
+};
+
+// Streaming health metrics, published as input variables.
+struct Metrics
+{
+    Metrics() : stalls{0}, latency_sum{0}, latency_max{0}, latency_count{0} {}
+
+    std::atomic<uint64_t>   stalls;        // Reads which returned no data.
+    uint64_t                latency_sum;   // Piece request to arrival latencies (ms) since the last publication.
+    uint64_t                latency_max;
+    uint64_t                latency_count;
+    Histogram               piece_latency; // Piece request to arrival latencies since the beginning.
+    Histogram               read_wait;     // Time spent by the demuxer waiting on reads.
+};
+
+// Most recently read piece buffers, seeks landing within one of them are served from memory.
+class PieceCache
+{
+    public:
+        PieceCache() : capacity_{0} {}
+
+        void Add(int id, const boost::shared_array<char>& data);
+        boost::shared_array<char> Get(int id);
+        void set_capacity(size_t capacity);
+
+    private:
+        size_t                                                 capacity_;
+        std::deque<std::pair<int, boost::shared_array<char>>> pieces_;
+};
+
+// Availability of the pieces of a file, as hexadecimal digits of 4 pieces each (most significant bit first).
+// For instance "f8" means that the first 5 pieces out of 8 are available.
+class FileAvailability
+{
+    public:
+        FileAvailability() : first_{0}, last_{-1} {}
+
+        void Reset(int first, int last);
+        bool Set(int piece);
+        const std::string& bitmap() const;
+
+    private:
+        int         first_;
+        int         last_;
+        std::string bitmap_;
+};
+
+// Event signaled whenever there might be something new to read. Waits return early when interrupted,
+// which the access does from its VLC interrupt callback (e.g. stop or seek).
+class ReadyEvent
+{
+    public:
+        ReadyEvent() : signaled_{false}, interrupted_{false} {}
+
+        void Signal();
+        void Clear();
+        void Interrupt();
+        bool Wait(std::chrono::milliseconds timeout);
+
+    private:
+        std::mutex              mutex_;
+        std::condition_variable cond_;
+        bool                    signaled_;
+        bool                    interrupted_;
+};
+
+// Record of the demuxer accesses, replayed by the benchmarks. After a "# torrent trace <file size>"
+// header, every call is a line starting with its time (us) since the beginning of the playback:
+//   <time> seek <offset> <duration (us)>
+//   <time> read <offset> <requested> <returned> <duration (us)>
+// where returned is -1 when no data was available in time and 0 at the end of the file.
+class AccessTrace
+{
+    public:
+        bool Open(const char* path, uint64_t file_size);
+        void Seek(time_point start, uint64_t offset);
+        void Read(time_point start, uint64_t offset, uint64_t requested, int64_t returned);
+        bool is_open() const;
+
+    private:
+        std::ofstream file_;
+        time_point    start_;
+};
+
+// Disk queue and cache sizes of the session, grown when the writes back up and shrunk back when the
+// download slows down, within the bounds of the streaming profile.
+class DiskTuner
+{
+    public:
+        DiskTuner() : DiskTuner{0, 0, 0, 0} {}
+        DiskTuner(int min_queue, int max_queue, int min_cache, int max_cache);
+
+        bool Update(int download_rate, int64_t queued_bytes); // Once per second, true if the sizes changed.
+        int disk_queue() const;
+        int cache_size() const;
+
+    private:
+        static const auto cache_time = 4;  // Seconds of download kept in the cache.
+        static const auto shrink_delay = 10; // Seconds with a small backlog before the disk queue shrinks.
+
+        int min_queue_;
+        int max_queue_;
+        int min_cache_;
+        int max_cache_;
+        int disk_queue_; // Bytes.
+        int cache_size_; // Units of 16 KiB.
+        int idle_;
+};
+
+class PiecePriorities
+{
+    public:
+        enum Priority {
+            discard    = 0, // Don't download.
+            keep       = 1, // Already downloaded, don't discard it.
+            background = 1, // Rest of the file, once the playhead is secure.
+            prefetch   = 5, // File head/tail and recent seek targets.
+            playhead   = 7  // Window ahead of the playhead.
+        };
+
+        PiecePriorities() : first_{0}, last_{-1}, playhead_{0}, contiguous_end_{0}, num_have_{0},
+                            playhead_window_{0}, prefetch_window_{0}, background_{false} {}
+
+        void Reset(int num_pieces, int first, int last, int playhead_window, int prefetch_window);
+        void SetHave(int piece);
+        void MovePlayhead(int piece);
+        void AddSeekTarget(int piece);
+        void SetPlayheadWindow(int window);
+        void SetBackground(bool enable);
+        void Update(std::vector<int>& changed);
+        int ContiguousHave() const;
+        bool Complete() const;
+
+        const std::vector<int>& priorities() const;
+        bool have(int piece) const;
+        bool background_download() const;
+        bool empty() const;
+
+    private:
+        static const auto max_seek_targets = 4;
+
+        int Compute(int piece) const;
+        void Invalidate(int piece, int len);
+        void AdvanceContiguousEnd(int from);
+
+        int                              first_;
+        int                              last_;
+        int                              playhead_;
+        int                              contiguous_end_; // First piece missing from the playhead on.
+        int                              num_have_;       // Pieces of the file available.
+        int                              playhead_window_;
+        int                              prefetch_window_;
+        bool                             background_;
+        std::deque<int>                  seek_targets_;
+        std::vector<bool>                have_;
+        std::vector<int>                 priorities_;
+        std::vector<std::pair<int, int>> dirty_;
+};
+
+// Location of the file being streamed within the torrent.
+struct FileLayout
+{
+    int      num_pieces;
+    int      piece_size;
+    uint64_t offset;     // Offset of the file within the torrent.
+    uint64_t size;
+
+    int piece(uint64_t off) const;
+    int piece_offset(uint64_t off) const;
+};
+
+// Torrent status as reported by an engine.
+struct EngineStatus
+{
+    lts::state_t state;
+    int          download_rate; // Payload rates (bytes/s).
+    int          upload_rate;
+    int          num_peers;
+};
+
+// Notification raised by an engine, the subset of the libtorrent alerts the access relies on.
+struct EngineEvent
+{
+    enum Type {
+        state_changed,
+        piece_finished,
+        torrent_checked,   // Pieces found on disk or restored from the resume data.
+        read_piece,
+        resume_data_saved,
+        metadata_received
+    };
+
+    EngineEvent(Type t, int p = -1) : type{t}, piece{p}, state{}, size{0} {}
+
+    Type                         type;
+    int                          piece;
+    lts::state_t                 state;
+    boost::shared_array<char>    data;        // Piece read, nullptr on read error.
+    int                          size;
+    std::vector<bool>            pieces;      // Pieces available (torrent_checked).
+    std::shared_ptr<lt::entry>   resume_data;
+};
+
+// BitTorrent engine driven by the streaming logic. Calls may come from both the thread reading
+// the file and the one polling the events, so implementations must be thread safe.
+class TorrentEngine
+{
+    public:
+        virtual ~TorrentEngine() = default;
+
+        virtual int AddTorrent(const lt::add_torrent_params& params) = 0;
+        virtual void RemoveTorrent(bool delete_files) = 0;
+        virtual bool PopEvents(std::chrono::milliseconds timeout, std::vector<EngineEvent>& events) = 0;
+        virtual void PrioritizePieces(const std::vector<int>& priorities) = 0;
+        virtual void SetPiecePriority(int piece, int priority) = 0;
+        virtual void SetPieceDeadline(int piece) = 0; // Raises a read_piece event once available.
+        virtual void ClearPieceDeadlines() = 0;
+        virtual void ReadPiece(int piece) = 0;
+        virtual void SetDownloadLimit(int rate) = 0;  // Bytes/s, -1 for unlimited.
+        virtual void ConnectPeer(const lt::tcp::endpoint& endpoint) = 0;
+
+        virtual bool has_torrent() const = 0;
+        virtual std::vector<bool> have_pieces() const = 0;
+        virtual EngineStatus status() const = 0;
+};
+
+// Engine backed by a libtorrent session, the session itself is left to TorrentAccess to configure.
+class LibtorrentEngine : public TorrentEngine
+{
+    public:
+        LibtorrentEngine();
+
+        int AddTorrent(const lt::add_torrent_params& params) override;
+        void RemoveTorrent(bool delete_files) override;
+        bool PopEvents(std::chrono::milliseconds timeout, std::vector<EngineEvent>& events) override;
+        void PrioritizePieces(const std::vector<int>& priorities) override;
+        void SetPiecePriority(int piece, int priority) override;
+        void SetPieceDeadline(int piece) override;
+        void ClearPieceDeadlines() override;
+        void ReadPiece(int piece) override;
+        void SetDownloadLimit(int rate) override;
+        void ConnectPeer(const lt::tcp::endpoint& endpoint) override;
+
+        bool has_torrent() const override;
+        std::vector<bool> have_pieces() const override;
+        EngineStatus status() const override;
+
+        void UpdateSessionStats(); // Sampled asynchronously since libtorrent 1.1.
+        std::vector<lt::tcp::endpoint> BestPeers(size_t max) const;
+
+        lt::session& session();
+        const lt::session& session() const;
+        const lt::torrent_handle& handle() const;
+        int64_t disk_queued_bytes() const; // Bytes waiting to be written, as of the last update.
+        int dht_nodes() const;             // Nodes in the DHT routing table, as of the last update.
+
+    private:
+#if LIBTORRENT_VERSION_NUM < 10100
+        lt::fingerprint      fingerprint_;
+#endif
+        lt::session          session_;
+        lt::torrent_handle   handle_;
+        std::atomic<int64_t> disk_queued_bytes_;
+        std::atomic_int      dht_nodes_;
+#if LIBTORRENT_VERSION_NUM >= 10100
+        int                  queued_write_bytes_idx_;
+        int                  dht_nodes_idx_;
+#endif
+};
+
+// Piece scheduling and delivery of a file being streamed, independent of the engine behind it.
+class PieceStreamer
+{
+    public:
+        PieceStreamer(vlc_object_t* obj, TorrentEngine& engine) :
+            obj_{obj},
+            engine_(engine),
+            layout_(),
+            background_threshold_{var_InheritInteger(obj, "background-download-threshold")},
+            consumed_bytes_{0},
+            block_size_{static_cast<uint64_t>(var_InheritInteger(obj, "torrent-block-size")) * 1024},
+            pause_window_{static_cast<int>(var_InheritInteger(obj, "pause-buffer-size")) * 1024 * 1024},
+            pause_download_rate_{static_cast<int>(var_InheritInteger(obj, "pause-download-rate-limit")) * 1024},
+            paused_{false},
+            window_factor_{1},
+            availability_changed_{false}
+        {}
+
+        int Start(const FileLayout& layout);
+        void HandleEvent(const EngineEvent& event);
+        void ReadNextPiece(Piece& piece, bool& eof, uint64_t max_length);
+        bool ReadReadyPiece(Piece& piece, uint64_t max_length);
+        void SelectPieces(uint64_t offset);
+        void SetPaused(bool paused);
+        int64_t PtsDelay();
+        void CountRead(std::chrono::microseconds wait, bool stalled);
+        void PublishStats(vlc_object_t* p_input);
+        bool WaitReady(std::chrono::milliseconds timeout);
+        void InterruptWait();
+
+        const Metrics& metrics() const;
+        uint64_t block_size() const;
+        uint64_t file_size() const;
+
+    private:
+        void HandleStateChanged(lts::state_t state);
+        void HandleReadPiece(const EngineEvent& event);
+        void HandlePieceFinished(int piece);
+        void SetHavePieces(const std::vector<bool>& pieces);
+        void ApplyPiecePriorities();
+        void UpdateBackgroundDownload();
+        void UpdatePlayheadWindow();
+        void ApplyPlayheadWindow();
+        uint64_t ConsumptionRate() const;
+        void RequestPieces(uint64_t size);
+        void PopNextPiece(Piece& piece, uint64_t max_length);
+
+        vlc_object_t*              obj_;
+        TorrentEngine&             engine_;
+        FileLayout                 layout_;
+        PiecesQueue                queue_;
+        PiecePriorities            priorities_;
+        PieceCache                 cache_;
+        std::chrono::seconds       background_threshold_;
+        time_point                 consumed_since_;
+        uint64_t                   consumed_bytes_;
+        uint64_t                   block_size_;
+        int                        pause_window_;
+        int                        pause_download_rate_;
+        bool                       paused_;
+        int                        window_factor_; // Playhead window scaling for the swarm speed.
+        FileAvailability           availability_;
+        bool                       availability_changed_;
+        Metrics                    metrics_;
+        Status                     status_;
+        ReadyEvent                 ready_;
+        time_point                 window_updated_;
+};
+
 class TorrentAccess
 {
     public:
@@ -85,60 +469,209 @@ class TorrentAccess
             access_{p_access},
             file_at_{-1},
             stopped_{false},
+            closing_{false},
             download_dir_{nullptr, std::free},
             cache_dir_{config_GetUserDir(VLC_CACHE_DIR), std::free},
             uri_{std::string{"torrent://"} + p_access->psz_location},
-            fingerprint_{"VL", PACKAGE_VERSION_MAJOR, PACKAGE_VERSION_MINOR,
-                               PACKAGE_VERSION_REVISION, PACKAGE_VERSION_EXTRA},
-            session_{fingerprint_}
+            streamer_{VLC_OBJECT(p_access), engine_},
+            session_started_{false},
+            dht_routers_added_{false},
+            dht_saved_nodes_{0}
         {}
         ~TorrentAccess();
 
         static int ParseURI(const std::string& uri, lt::add_torrent_params& params);
         int RetrieveTorrentMetadata();
         int StartDownload(int file_at);
-        void ReadNextPiece(Piece& piece, bool& eof);
+        void ReadNextPiece(Piece& piece, bool& eof, uint64_t max_length);
+        bool ReadReadyPiece(Piece& piece, uint64_t max_length);
         void SelectPieces(uint64_t offset);
+        void SetPaused(bool paused);
+        int64_t PtsDelay();
+        void CountRead(std::chrono::microseconds wait, bool stalled);
+        bool WaitReady(std::chrono::milliseconds timeout);
+        void InterruptWait();
+        void AddPeer(const lt::tcp::endpoint& endpoint);
 
         void set_download_dir(unique_char_ptr&& dir);
         void set_parameters(lt::add_torrent_params&& params);
         const lt::torrent_info& torrent_metadata() const;
         bool has_torrent_metadata() const;
         const std::string& uri() const;
+        uint64_t block_size() const;
+        uint64_t file_size() const;
 
     private:
         void Run();
+        void SetAlertMask(bool downloading);
+        void StartSession();
         void SetSessionSettings();
+        void StartDHT();
+        void AddDHTRouters();
+        void MaintainDHT();
+        void TuneDiskSettings();
         void SaveSessionStates(bool save_resume_data) const;
-        void HandleStateChanged(const lt::alert* alert);
-        void HandleSaveResumeData(const lt::alert* alert) const;
-        void HandleReadPiece(const lt::alert* alert);
+        void SaveDHTState() const;
+        void SavePeers() const;
+        void HandleSaveResumeData(const EngineEvent& event) const;
+        void PublishStats();
+        void DumpStats() const;
         std::string CacheSave(const std::string& name, const lt::entry& entry) const;
         std::string CacheLookup(const std::string& name) const;
         std::vector<char> CacheLoad(const std::string& name) const;
         void CacheDel(const std::string& name) const;
 
-        const std::string& torrent_hash() const;
+        std::string torrent_hash() const;
         void set_uri(const std::string& uri);
         void set_torrent_metadata(const lt::torrent_info& metadata);
         void set_torrent_metadata(const std::string& path, lt::error_code& ec);
 
-        access_t*                  access_;
-        int                        file_at_;
-        std::atomic_bool           stopped_;
-        unique_char_ptr            download_dir_;
-        unique_char_ptr            cache_dir_;
-        std::string                uri_;
-        lt::fingerprint            fingerprint_;
-        lt::session                session_;
-        mutable std::promise<void> resume_data_saved_;
-        PiecesQueue                queue_;
-        Status                     status_;
-        lt::add_torrent_params     params_;
-        lt::torrent_handle         handle_;
-        std::thread                thread_;
+        access_t*                      access_;
+        int                            file_at_;
+        std::atomic_bool               stopped_;
+        std::atomic_bool               closing_; // The torrent is being saved and removed, Run still serves it.
+        unique_char_ptr                download_dir_;
+        unique_char_ptr                cache_dir_;
+        std::string                    uri_;
+        LibtorrentEngine               engine_;
+        PieceStreamer                  streamer_;
+        mutable std::promise<void>     resume_data_saved_;
+        mutable std::mutex             dht_state_mutex_;   // Checkpoints and the final save may overlap.
+        time_point                     stats_published_;
+        DiskTuner                      disk_tuner_;
+        time_point                     disk_tuned_;
+        bool                           session_started_;
+        bool                           dht_routers_added_;
+        time_point                     dht_started_;
+        time_point                     dht_checked_;
+        time_point                     dht_saved_;
+        int                            dht_saved_nodes_;
+        lt::add_torrent_params         params_;
+        std::vector<lt::tcp::endpoint> saved_peers_; // Best peers of the previous sessions.
+        std::thread                    thread_;
 };
 
+inline uint64_t Histogram::count() const
+{
+    uint64_t n = 0;
+    for (const auto& b : buckets_)
+        n += b.load(std::memory_order_relaxed);
+    return n;
+}
+
+inline void PieceCache::set_capacity(size_t capacity)
+{
+    capacity_ = capacity;
+}
+
+inline const std::string& FileAvailability::bitmap() const
+{
+    return bitmap_;
+}
+
+
+inline bool AccessTrace::is_open() const
+{
+    return file_.is_open();
+}
+
+inline int DiskTuner::disk_queue() const
+{
+    return disk_queue_;
+}
+
+inline int DiskTuner::cache_size() const
+{
+    return cache_size_;
+}
+
+inline const std::vector<int>& PiecePriorities::priorities() const
+{
+    return priorities_;
+}
+
+inline bool PiecePriorities::have(int piece) const
+{
+    return have_[piece];
+}
+
+inline bool PiecePriorities::background_download() const
+{
+    return background_;
+}
+
+inline bool PiecePriorities::empty() const
+{
+    return priorities_.empty();
+}
+
+inline int FileLayout::piece(uint64_t off) const
+{
+    return (offset + off) / piece_size;
+}
+
+inline int FileLayout::piece_offset(uint64_t off) const
+{
+    return (offset + off) % piece_size;
+}
+
+inline lt::session& LibtorrentEngine::session()
+{
+    return session_;
+}
+
+inline const lt::session& LibtorrentEngine::session() const
+{
+    return session_;
+}
+
+inline const lt::torrent_handle& LibtorrentEngine::handle() const
+{
+    return handle_;
+}
+
+inline int64_t LibtorrentEngine::disk_queued_bytes() const
+{
+    return disk_queued_bytes_.load(std::memory_order_relaxed);
+}
+
+inline int LibtorrentEngine::dht_nodes() const
+{
+    return dht_nodes_.load(std::memory_order_relaxed);
+}
+
+inline const Metrics& PieceStreamer::metrics() const
+{
+    return metrics_;
+}
+
+inline uint64_t PieceStreamer::block_size() const
+{
+    return block_size_;
+}
+
+inline uint64_t PieceStreamer::file_size() const
+{
+    return layout_.size;
+}
+
+inline bool PieceStreamer::WaitReady(std::chrono::milliseconds timeout)
+{
+    return ready_.Wait(timeout);
+}
+
+inline void PieceStreamer::InterruptWait()
+{
+    ready_.Interrupt();
+}
+
+inline void PieceStreamer::CountRead(std::chrono::microseconds wait, bool stalled)
+{
+    metrics_.read_wait.Add(wait);
+    if (stalled)
+        ++metrics_.stalls;
+}
+
 inline void TorrentAccess::set_download_dir(unique_char_ptr&& dir)
 {
     download_dir_ = std::move(dir);
@@ -181,8 +714,73 @@ inline const std::string& TorrentAccess::uri() const
     return uri_;
 }
 
-inline const std::string& TorrentAccess::torrent_hash() const
+inline uint64_t TorrentAccess::block_size() const
 {
-    static const auto hash = lt::to_hex(params_.info_hash.to_string());
-    return hash;
+    return streamer_.block_size();
 }
+
+inline uint64_t TorrentAccess::file_size() const
+{
+    if (file_at_ < 0)
+        return 0;
+    return streamer_.file_size();
+}
+
+inline void TorrentAccess::ReadNextPiece(Piece& piece, bool& eof, uint64_t max_length)
+{
+    streamer_.ReadNextPiece(piece, eof, max_length);
+}
+
+inline bool TorrentAccess::ReadReadyPiece(Piece& piece, uint64_t max_length)
+{
+    return streamer_.ReadReadyPiece(piece, max_length);
+}
+
+inline void TorrentAccess::SelectPieces(uint64_t offset)
+{
+    streamer_.SelectPieces(offset);
+}
+
+inline void TorrentAccess::SetPaused(bool paused)
+{
+    streamer_.SetPaused(paused);
+}
+
+inline int64_t TorrentAccess::PtsDelay()
+{
+    return streamer_.PtsDelay();
+}
+
+inline void TorrentAccess::CountRead(std::chrono::microseconds wait, bool stalled)
+{
+    streamer_.CountRead(wait, stalled);
+}
+
+inline bool TorrentAccess::WaitReady(std::chrono::milliseconds timeout)
+{
+    return streamer_.WaitReady(timeout);
+}
+
+inline void TorrentAccess::InterruptWait()
+{
+    streamer_.InterruptWait();
+}
+
+inline void TorrentAccess::AddPeer(const lt::tcp::endpoint& endpoint)
+{
+    engine_.ConnectPeer(endpoint);
+}
+
+// The parameters of a torrent file only carry the info hash in its metadata.
+inline std::string TorrentAccess::torrent_hash() const
+{
+    std::ostringstream os;
+#if LIBTORRENT_VERSION_NUM >= 20000
+    os << (has_torrent_metadata() ? torrent_metadata().info_hashes() : params_.info_hashes).get_best();
+#else
+    os << (has_torrent_metadata() ? torrent_metadata().info_hash() : params_.info_hash);
+#endif
+    return os.str();
+}
+
+#endif